@@ -0,0 +1,334 @@
+#define _GNU_SOURCE
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "stats.h"
+#include "timer.h"
+#include "utils.h"
+
+#define NUM_TEST_ITERATIONS     100
+#define MIN_TRANSFER_SIZE       (4 * 1024)
+#define MAX_TRANSFER_SIZE       (16 * 1024 * 1024)
+
+#define METHOD_PIPE             0
+#define METHOD_SHM              1
+#define METHOD_VM_WRITEV        2
+#define METHOD_VM_READV         3
+#define NUM_METHODS             4
+
+/*
+ * Compares ways of handing a buffer from the parent to the child, including
+ * the wakeup that tells the child the data is there. Each iteration starts
+ * when the parent begins the transfer and ends when the child has the data
+ * in its own private buffer and records tick(), as in pipe-timer.
+ *
+ *   pipe        - the parent writes a header and then the data to a pipe;
+ *                 the child reads both.
+ *   shm         - the parent copies the data into the create_shared_memory()
+ *                 region and writes a header to the pipe; the child copies
+ *                 the data out.
+ *   vm_writev   - the parent copies the data straight into the child's
+ *                 buffer with process_vm_writev() and writes a header.
+ *   vm_readv    - the parent writes a header and the child pulls the data
+ *                 from the parent's buffer with process_vm_readv().
+ *
+ * The parent and child buffers are allocated before the fork, so each side
+ * knows the other's addresses. The first and last byte of every transfer
+ * carry the iteration number, which the child checks.
+ */
+
+typedef struct {
+  int                   method;
+  uint32_t              size;
+  uint8_t               sequence;
+  int                   child_should_exit;
+} transfer_msg_t;
+
+typedef struct {
+  uint64_t              tick;
+  int                   ok;
+} transfer_reply_msg_t;
+
+typedef struct {
+  int                   send_fd;
+  int                   recv_fd;
+  char                  *src;           // parent's buffer
+  char                  *dst;           // child's buffer
+  char                  *shm;
+  pid_t                 peer_pid;
+} transfer_state_t;
+
+static const char *method_names[NUM_METHODS] = {
+  "pipe", "shm", "vm_writev", "vm_readv"
+};
+
+int parent_transfer(transfer_state_t *statep, int method, uint32_t size,
+    uint8_t sequence, uint64_t *nanosecondsp);
+int child_process(transfer_state_t *statep, size_t buffer_size);
+int logging_enabled = 0;
+test_args_t test_args = { .iterations = NUM_TEST_ITERATIONS };
+
+int
+main(int argc, char** argv)
+{
+  int                   rv = 0, iterations, size;
+  int                   pipe1[2], pipe2[2];
+  size_t                buffer_size;
+  pid_t                 fork_pid;
+  transfer_state_t      state = {};
+
+  timer_init();
+
+  rv = get_args(argc, argv, ARGS_TRANSFER, &test_args);
+  if (rv != 0) {
+    exit(rv);
+  }
+  logging_enabled = test_args.logging;
+  iterations = test_args.iterations;
+  size = test_args.transfer_bytes;
+
+  buffer_size = size ? size : MAX_TRANSFER_SIZE;
+  state.src = malloc(buffer_size);
+  state.dst = malloc(buffer_size);
+  state.shm = create_shared_memory(buffer_size);
+  if (state.src == NULL || state.dst == NULL || state.shm == MAP_FAILED) {
+    LOG_ERR("buffer allocation failed\n");
+    exit(-1);
+  }
+  // The private buffers are faulted in after the fork (below), since pages
+  // touched before it would be copy-on-write in both processes.
+  memset(state.shm, 0, buffer_size);
+
+  if (pipe(pipe1) == -1 || pipe(pipe2) == -1) {
+    LOG_ERR("pipe() failed\n");
+    exit(-1);
+  }
+
+  fork_pid = fork();
+  if (fork_pid == -1) {
+    LOG_ERR("fork() failed\n");
+    exit(-1);
+  } else if (fork_pid == 0) {
+    LOG("child PID: %d\n", getpid());
+
+    // pipe1: parent->child (header and pipe data)
+    // pipe2: child->parent (reply)
+    close(pipe1[PIPE_WR_END]);
+    close(pipe2[PIPE_RD_END]);
+
+    state.recv_fd = pipe1[PIPE_RD_END];
+    state.send_fd = pipe2[PIPE_WR_END];
+    state.peer_pid = getppid();
+
+    exit(child_process(&state, buffer_size));
+  }
+
+  LOG("parent PID: %d\n", getpid());
+
+  close(pipe1[PIPE_RD_END]);
+  close(pipe2[PIPE_WR_END]);
+
+  state.send_fd = pipe1[PIPE_WR_END];
+  state.recv_fd = pipe2[PIPE_RD_END];
+  state.peer_pid = fork_pid;
+
+  // fault in our buffer and wait for the child to fault in its own, so that
+  // first-touch page faults are not charged to the first transfers
+  memset(state.src, 0, buffer_size);
+  {
+    transfer_reply_msg_t ready;
+
+    if (read_bytes(state.recv_fd, sizeof (ready), &ready) != 0 || !ready.ok) {
+      LOG_ERR("child failed to start\n");
+      exit(-1);
+    }
+  }
+
+  // With Yama ptrace_scope=1 only ancestors may use process_vm_readv() on a
+  // process, so explicitly allow the child to read from us. This fails
+  // harmlessly where Yama is not present.
+  (void) prctl(PR_SET_PTRACER, fork_pid, 0, 0, 0);
+
+  for (uint32_t s = size ? size : MIN_TRANSFER_SIZE;
+       s <= buffer_size && rv == 0; s *= 4) {
+    PRINT("%" PRIu32 " bytes:\n", s);
+
+    for (int method = 0; method < NUM_METHODS && rv == 0; method++) {
+      latency_stats_t stats;
+      histogram_t *histp = &stats.all;
+      uint64_t average;
+
+      stats_init(&stats, 0, 0);
+      // iteration -1 is an untimed warm-up, so that the first timed transfer
+      // does not pay for cold caches and pipe buffer allocation
+      for (int i = -1; i < iterations; i++) {
+        uint64_t delta;
+
+        rv = parent_transfer(&state, method, s, i, &delta);
+        if (rv != 0) {
+          LOG_ERR("%s transfer of %" PRIu32 " bytes failed\n",
+                  method_names[method], s);
+          break;
+        }
+        if (i < 0)
+          continue;
+        LOG("%s: %" PRIu64 " nanoseconds\n", method_names[method], delta);
+        stats_record(&stats, delta);
+      }
+      if (histp->count == 0)
+        continue;
+
+      average = histp->total / histp->count;
+      PRINT("  %-10s average %" PRIu64 ", p50 %" PRIu64 ", p99 %" PRIu64
+          " nanoseconds, %.0f MB/s\n", method_names[method], average,
+          stats_percentile(histp, 50.0), stats_percentile(histp, 99.0),
+          (double)s * 1000.0 / (average ? average : 1));
+    }
+
+    if (size)
+      break;
+  }
+
+  {
+    transfer_msg_t exit_msg = {};
+
+    exit_msg.child_should_exit = 1;
+    (void) write_bytes(state.send_fd, sizeof (exit_msg), &exit_msg);
+    (void) waitpid(fork_pid, NULL, 0);
+  }
+
+  exit(rv);
+}
+
+// Runs one transfer and returns its end-to-end time in *nanosecondsp.
+// Returns 0 on success.
+int
+parent_transfer(transfer_state_t *statep, int method, uint32_t size,
+    uint8_t sequence, uint64_t *nanosecondsp)
+{
+  int                   rv;
+  transfer_msg_t        msg = {};
+  transfer_reply_msg_t  reply = {};
+  struct iovec          local, remote;
+  uint64_t              start;
+
+  msg.method = method;
+  msg.size = size;
+  msg.sequence = sequence;
+  statep->src[0] = statep->src[size - 1] = sequence;
+
+  start = tick();
+  switch (method)
+  {
+  case METHOD_PIPE:
+    rv = write_bytes(statep->send_fd, sizeof (msg), &msg);
+    if (rv == 0)
+      rv = write_bytes(statep->send_fd, size, statep->src);
+    break;
+  case METHOD_SHM:
+    memcpy(statep->shm, statep->src, size);
+    rv = write_bytes(statep->send_fd, sizeof (msg), &msg);
+    break;
+  case METHOD_VM_WRITEV:
+    local.iov_base = statep->src;
+    local.iov_len = size;
+    remote.iov_base = statep->dst;
+    remote.iov_len = size;
+    if (process_vm_writev(statep->peer_pid, &local, 1, &remote, 1, 0) != size) {
+      LOG_ERR("process_vm_writev() failed\n");
+      return -1;
+    }
+    rv = write_bytes(statep->send_fd, sizeof (msg), &msg);
+    break;
+  case METHOD_VM_READV:
+    rv = write_bytes(statep->send_fd, sizeof (msg), &msg);
+    break;
+  default:
+    return -1;
+  }
+  if (rv != 0) {
+    return rv;
+  }
+
+  rv = read_bytes(statep->recv_fd, sizeof (reply), &reply);
+  if (rv != 0 || !reply.ok) {
+    return -1;
+  }
+
+  *nanosecondsp = tick_delta_to_nanoseconds(reply.tick - start);
+
+  return 0;
+}
+
+int
+child_process(transfer_state_t *statep, size_t buffer_size)
+{
+  int rv;
+  transfer_reply_msg_t ready = { .ok = 1 };
+
+  memset(statep->dst, 0, buffer_size);
+  rv = write_bytes(statep->send_fd, sizeof (ready), &ready);
+  if (rv != 0) {
+    return rv;
+  }
+
+  while (1) {
+    transfer_msg_t        msg = {};
+    transfer_reply_msg_t  reply = {};
+    struct iovec          local, remote;
+
+    rv = read_bytes(statep->recv_fd, sizeof (msg), &msg);
+    if (rv != 0) {
+      LOG_ERR("%s: error: read_bytes returned %d\n", __FUNCTION__, rv);
+      break;
+    }
+
+    if (msg.child_should_exit) {
+      break;
+    }
+
+    switch (msg.method)
+    {
+    case METHOD_PIPE:
+      rv = read_bytes(statep->recv_fd, msg.size, statep->dst);
+      break;
+    case METHOD_SHM:
+      memcpy(statep->dst, statep->shm, msg.size);
+      break;
+    case METHOD_VM_WRITEV:
+      // the data is already in place
+      break;
+    case METHOD_VM_READV:
+      local.iov_base = statep->dst;
+      local.iov_len = msg.size;
+      remote.iov_base = statep->src;
+      remote.iov_len = msg.size;
+      if (process_vm_readv(statep->peer_pid, &local, 1, &remote, 1, 0) !=
+          msg.size) {
+        LOG_ERR("process_vm_readv() failed\n");
+        rv = -1;
+      }
+      break;
+    }
+    reply.tick = tick();
+
+    reply.ok = rv == 0 &&
+               (uint8_t)statep->dst[0] == msg.sequence &&
+               (uint8_t)statep->dst[msg.size - 1] == msg.sequence;
+    rv = write_bytes(statep->send_fd, sizeof (reply), &reply);
+    if (rv != 0) {
+      break;
+    }
+  }
+
+  return rv;
+}
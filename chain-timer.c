@@ -0,0 +1,289 @@
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "stats.h"
+#include "timer.h"
+#include "utils.h"
+
+#define NUM_TEST_ITERATIONS     1000
+#define NUM_STAGES              4
+#define MAX_STAGES              32
+
+/*
+ * Measures how wakeup latency compounds along a pipeline. The parent and H
+ * forwarding stages are connected in a ring by H + 1 channels:
+ *
+ *   parent -> stage 1 -> stage 2 -> ... -> stage H -> parent
+ *
+ * The parent records tick() and sends a token. Each stage blocks reading its
+ * input channel, records tick() in the token as soon as it wakes and writes
+ * the token to its output channel. The parent records the final tick when the
+ * token comes back. Each hop is therefore timed from the previous stage's
+ * wakeup, through its write, to the next stage's wakeup, as in pipe-timer, and
+ * the hops add up to the end-to-end time.
+ *
+ * Each stage is a child process or a thread of the parent, and each channel
+ * can be any transport create_channel() supports. -H gives either the number
+ * of stages, which then all follow -T and -x, or a list such as
+ * "p:pipe,t:tcp,p:unix" that picks the kind of every stage and the transport
+ * of the channel into it. The channel back to the parent always uses -x.
+ */
+
+typedef struct {
+  int                   child_should_exit;
+  uint64_t              ticks[MAX_STAGES + 2];
+} token_msg_t;
+
+typedef struct {
+  int                   stage;
+  int                   recv_fd;
+  int                   send_fd;
+} stage_state_t;
+
+// How stage s of the pipeline runs and how the token reaches it.
+typedef struct {
+  int                   thread;         // thread of the parent, not a process
+  int                   transport;      // TRANSPORT_* of the channel into it
+} stage_spec_t;
+
+static const char *transport_names[] = { "pipe", "unix", "tcp", "udp" };
+
+int stage_process(stage_state_t *statep);
+void* stage_thread_func(void *data);
+int logging_enabled = 0;
+test_args_t test_args = { .iterations = NUM_TEST_ITERATIONS };
+
+// Fills in specs[1..] from |spec|, which is either a stage count or a comma
+// separated list of "p" or "t" stages, each optionally followed by
+// ":<transport>". Stages default to -T and -x. Returns the number of stages,
+// or -1 if |spec| is invalid.
+static int
+parse_stages(const char *spec, stage_spec_t *specs)
+{
+  char buf[256], *entry, *saveptr = NULL, *end = NULL;
+  int stages = 0;
+
+  if (spec == NULL || (spec[0] >= '0' && spec[0] <= '9')) {
+    stages = spec ? (int)strtol(spec, &end, 10) : NUM_STAGES;
+    if ((end && *end != '\0') || stages <= 0 || stages > MAX_STAGES)
+      return -1;
+    for (int s = 1; s <= stages; s++) {
+      specs[s].thread = test_args.threads;
+      specs[s].transport = test_args.transport;
+    }
+    return stages;
+  }
+
+  if (strlen(spec) >= sizeof (buf))
+    return -1;
+  strcpy(buf, spec);
+
+  for (entry = strtok_r(buf, ",", &saveptr); entry != NULL;
+       entry = strtok_r(NULL, ",", &saveptr)) {
+    stage_spec_t *specp = &specs[++stages];
+
+    if (stages > MAX_STAGES)
+      return -1;
+    if (entry[0] == 'p')
+      specp->thread = 0;
+    else if (entry[0] == 't')
+      specp->thread = 1;
+    else
+      return -1;
+
+    if (entry[1] == '\0') {
+      specp->transport = test_args.transport;
+    } else if (entry[1] == ':') {
+      specp->transport = parse_transport(entry + 2);
+      if (specp->transport == -1)
+        return -1;
+    } else {
+      return -1;
+    }
+  }
+
+  return stages ? stages : -1;
+}
+
+int
+main(int argc, char** argv)
+{
+  int                   rv = 0, stages;
+  int                   channels[MAX_STAGES + 1][2];
+  stage_spec_t          specs[MAX_STAGES + 1];
+  stage_state_t         stage_states[MAX_STAGES + 1];
+  pid_t                 stage_pids[MAX_STAGES + 1];
+  pthread_t             stage_threads[MAX_STAGES + 1];
+  latency_stats_t       hop_stats[MAX_STAGES + 1], stats;
+  uint64_t              deadline_tick;
+
+  timer_init();
+
+  rv = get_args(argc, argv, ARGS_SLEEP | ARGS_THREADS | ARGS_SOAK |
+                ARGS_TRANSPORT | ARGS_CHAIN, &test_args);
+  if (rv != 0) {
+    exit(rv);
+  }
+  logging_enabled = test_args.logging;
+
+  stages = parse_stages(test_args.stages, specs);
+  if (stages == -1) {
+    LOG_ERR("Option -H should be between 1 and %d, or a list of up to %d "
+            "stages such as p:pipe,t:tcp.\n", MAX_STAGES, MAX_STAGES);
+    exit(-1);
+  }
+
+  // channel k carries the token from stage k to stage k + 1, where the
+  // parent is both stage 0 and stage H + 1; the channel back to the parent
+  // uses -x
+  for (int k = 0; k <= stages; k++) {
+    int transport = k < stages ? specs[k + 1].transport : test_args.transport;
+
+    if (create_channel(transport, test_args.busy_poll_microseconds,
+                       channels[k]) != 0) {
+      LOG_ERR("create_channel() failed\n");
+      exit(-1);
+    }
+  }
+
+  for (int s = 1; s <= stages; s++) {
+    stage_states[s].stage = s;
+    stage_states[s].recv_fd = channels[s - 1][PIPE_RD_END];
+    stage_states[s].send_fd = channels[s][PIPE_WR_END];
+  }
+
+  // Fork the process stages before starting any threads, so that no child is
+  // forked while a thread stage holds a lock.
+  for (int s = 1; s <= stages; s++) {
+    if (specs[s].thread)
+      continue;
+
+    stage_pids[s] = fork();
+    if (stage_pids[s] == -1) {
+      LOG_ERR("fork() failed\n");
+      exit(-1);
+    } else if (stage_pids[s] == 0) {
+      LOG("stage %d PID: %d\n", s, getpid());
+      exit(stage_process(&stage_states[s]));
+    }
+  }
+
+  for (int s = 1; s <= stages; s++) {
+    if (!specs[s].thread)
+      continue;
+
+    rv = pthread_create(&stage_threads[s], NULL, stage_thread_func,
+                        &stage_states[s]);
+    if (rv != 0) {
+      LOG_ERR("pthread_create() failed\n");
+      exit(-1);
+    }
+  }
+
+  LOG("parent PID: %d\n", getpid());
+
+  for (int k = 0; k <= stages; k++)
+    stats_init(&hop_stats[k], 0, 0);
+  stats_init(&stats, (uint64_t)test_args.window_seconds * 1000000000,
+      test_args.threshold_nanoseconds);
+  deadline_tick = stats_deadline_tick(&stats, test_args.duration_seconds);
+
+  for (int i = 0; i <= test_args.iterations; i++) {
+    token_msg_t token = {};
+    uint64_t delta;
+
+    if (i == test_args.iterations || deadline_passed(deadline_tick)) {
+      // we're done
+      token.child_should_exit = 1;
+    } else if (test_args.sleep_microseconds) {
+      random_usleep(test_args.sleep_microseconds);
+    }
+
+    token.ticks[0] = tick();
+    rv = write_bytes(channels[0][PIPE_WR_END], sizeof (token), &token);
+    if (rv != 0) {
+      break;
+    }
+
+    rv = read_bytes(channels[stages][PIPE_RD_END], sizeof (token), &token);
+    token.ticks[stages + 1] = tick();
+    if (rv != 0 || token.child_should_exit) {
+      break;
+    }
+
+    for (int k = 0; k <= stages; k++) {
+      stats_record(&hop_stats[k],
+          tick_delta_to_nanoseconds(token.ticks[k + 1] - token.ticks[k]));
+    }
+    delta = tick_delta_to_nanoseconds(token.ticks[stages + 1] -
+                                      token.ticks[0]);
+    LOG("%" PRIu64 " nanoseconds\n", delta);
+    stats_record(&stats, delta);
+  }
+
+  for (int s = 1; s <= stages; s++) {
+    if (specs[s].thread)
+      (void) pthread_join(stage_threads[s], NULL);
+    else
+      (void) waitpid(stage_pids[s], NULL, 0);
+  }
+
+  for (int k = 0; k <= stages; k++) {
+    histogram_t *histp = &hop_stats[k].all;
+    const char *to = k == stages ? "parent" :
+                     specs[k + 1].thread ? "thread" : "process";
+    int transport = k < stages ? specs[k + 1].transport : test_args.transport;
+
+    if (histp->count == 0)
+      continue;
+
+    PRINT("hop %2d -> %-2d %-4s to %-7s average %" PRIu64 ", p50 %" PRIu64
+        ", p99 %" PRIu64 ", max %" PRIu64 " nanoseconds\n", k,
+        k == stages ? 0 : k + 1, transport_names[transport],
+        to, histp->total / histp->count,
+        stats_percentile(histp, 50.0), stats_percentile(histp, 99.0),
+        histp->max);
+  }
+  PRINT("end to end:\n");
+  stats_print(&stats);
+
+  exit(rv);
+}
+
+int
+stage_process(stage_state_t *statep)
+{
+  int rv;
+
+  while (1) {
+    token_msg_t token;
+
+    rv = read_bytes(statep->recv_fd, sizeof (token), &token);
+    if (rv != 0) {
+      LOG_ERR("%s: error: read_bytes returned %d\n", __FUNCTION__, rv);
+      break;
+    }
+    token.ticks[statep->stage] = tick();
+
+    rv = write_bytes(statep->send_fd, sizeof (token), &token);
+    if (rv != 0 || token.child_should_exit) {
+      break;
+    }
+  }
+
+  return rv;
+}
+
+void*
+stage_thread_func(void *data)
+{
+  (void) stage_process((stage_state_t *)data);
+
+  return NULL;
+}
@@ -0,0 +1,211 @@
+#define _GNU_SOURCE
+
+#include <inttypes.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "timer.h"
+#include "utils.h"
+
+#define NUM_TEST_ITERATIONS     10000
+#define NUM_WARMUP_ITERATIONS   1000
+
+/*
+ * Measures the hardware floor for a wakeup between two CPUs: the round trip
+ * time of a cache line bounced between a parent process pinned to one CPU
+ * and a child process pinned to another. Both sides spin on a flag in memory
+ * shared via create_shared_memory() and never enter the kernel, so the result
+ * is the cost of cache coherency traffic alone.
+ *
+ * For every ordered pair of CPUs (a, b) the parent, on CPU a, writes an odd
+ * value to the flag and spins until the child, on CPU b, has written the
+ * next even value back. The average round trip over all iterations is
+ * printed as an NxN matrix, with the parent's CPU as the row.
+ *
+ * parent:                          child:
+ *   loop:                            loop:
+ *     flag = 2i + 1                    wait for flag == 2i + 1
+ *     wait for flag == 2i + 2          flag = 2i + 2
+ */
+
+typedef struct {
+  // keep the flag on its own cache line so that only the ping-pong traffic
+  // moves it between CPUs
+  volatile uint64_t     flag __attribute__((aligned(CACHE_LINE_SIZE)));
+  volatile int          child_ready __attribute__((aligned(CACHE_LINE_SIZE)));
+} shared_memory_t;
+
+int pin_to_cpu(int cpu);
+uint64_t measure_pair(shared_memory_t *shm, int parent_cpu, int child_cpu,
+    int iterations);
+void child_process(shared_memory_t *shm, int cpu, int iterations);
+int logging_enabled = 0;
+test_args_t test_args = { .iterations = NUM_TEST_ITERATIONS };
+
+int
+main(int argc, char** argv)
+{
+  int                   rv, iterations;
+  int                   num_cpus = 0, *cpus;
+  uint64_t              *matrix;
+  cpu_set_t             allowed;
+  shared_memory_t       *shm;
+
+  timer_init();
+
+  // restrict the set of CPUs by running under taskset(1)
+  rv = get_args(argc, argv, 0, &test_args);
+  if (rv != 0) {
+    exit(rv);
+  }
+  logging_enabled = test_args.logging;
+  iterations = test_args.iterations;
+
+  if (sched_getaffinity(0, sizeof (allowed), &allowed) == -1) {
+    LOG_ERR("sched_getaffinity() failed\n");
+    exit(-1);
+  }
+
+  cpus = calloc(CPU_COUNT(&allowed), sizeof (int));
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET(cpu, &allowed))
+      cpus[num_cpus++] = cpu;
+  }
+
+  matrix = calloc(num_cpus * num_cpus, sizeof (uint64_t));
+
+  shm = (shared_memory_t*) create_shared_memory(sizeof (shared_memory_t));
+  if (shm == MAP_FAILED) {
+    LOG_ERR("create_shared_memory() failed\n");
+    exit(-1);
+  }
+
+  for (int a = 0; a < num_cpus; a++) {
+    for (int b = 0; b < num_cpus; b++) {
+      if (a == b)
+        continue;
+
+      matrix[a * num_cpus + b] = measure_pair(shm, cpus[a], cpus[b],
+                                              iterations);
+      if (matrix[a * num_cpus + b] == 0) {
+        exit(-1);
+      }
+      LOG("CPU %d -> CPU %d: %" PRIu64 " nanoseconds\n",
+          cpus[a], cpus[b], matrix[a * num_cpus + b]);
+    }
+  }
+
+  PRINT("round trip nanoseconds over %d iterations (row: parent CPU, "
+        "column: child CPU)\n", iterations);
+  PRINT("%6s", "");
+  for (int b = 0; b < num_cpus; b++)
+    PRINT(" %6d", cpus[b]);
+  PRINT("\n");
+  for (int a = 0; a < num_cpus; a++) {
+    PRINT("%6d", cpus[a]);
+    for (int b = 0; b < num_cpus; b++) {
+      if (a == b)
+        PRINT(" %6s", "-");
+      else
+        PRINT(" %6" PRIu64, matrix[a * num_cpus + b]);
+    }
+    PRINT("\n");
+  }
+
+  free(matrix);
+  free(cpus);
+
+  exit(0);
+}
+
+int
+pin_to_cpu(int cpu)
+{
+  cpu_set_t set;
+
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  return sched_setaffinity(0, sizeof (set), &set);
+}
+
+// Returns the average round trip in nanoseconds, or 0 on failure.
+uint64_t
+measure_pair(shared_memory_t *shm, int parent_cpu, int child_cpu,
+    int iterations)
+{
+  pid_t                 fork_pid;
+  uint64_t              start, end, value = 0;
+  int                   status;
+
+  shm->flag = 0;
+  shm->child_ready = 0;
+
+  if (pin_to_cpu(parent_cpu) == -1) {
+    LOG_ERR("sched_setaffinity(%d) failed\n", parent_cpu);
+    return 0;
+  }
+
+  fork_pid = fork();
+  if (fork_pid == -1) {
+    LOG_ERR("fork() failed\n");
+    return 0;
+  } else if (fork_pid == 0) {
+    child_process(shm, child_cpu, NUM_WARMUP_ITERATIONS + iterations);
+  }
+
+  while (!shm->child_ready)
+    cpu_relax();
+
+  if (shm->child_ready == -1) {
+    (void) waitpid(fork_pid, &status, 0);
+    return 0;
+  }
+
+  for (int i = 0; i < NUM_WARMUP_ITERATIONS + iterations; i++) {
+    if (i == NUM_WARMUP_ITERATIONS)
+      start = tick();
+
+    __atomic_store_n(&shm->flag, ++value, __ATOMIC_RELEASE);
+    ++value;
+    while (__atomic_load_n(&shm->flag, __ATOMIC_ACQUIRE) != value)
+      cpu_relax();
+  }
+  end = tick();
+
+  if (waitpid(fork_pid, &status, 0) == -1 ||
+      !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    LOG_ERR("child for CPU %d failed\n", child_cpu);
+    return 0;
+  }
+
+  return tick_delta_to_nanoseconds(end - start) / iterations;
+}
+
+void
+child_process(shared_memory_t *shm, int cpu, int iterations)
+{
+  uint64_t value = 0;
+
+  if (pin_to_cpu(cpu) == -1) {
+    LOG_ERR("sched_setaffinity(%d) failed\n", cpu);
+    shm->child_ready = -1;
+    _exit(-1);
+  }
+
+  shm->child_ready = 1;
+
+  for (int i = 0; i < iterations; i++) {
+    ++value;
+    while (__atomic_load_n(&shm->flag, __ATOMIC_ACQUIRE) != value)
+      cpu_relax();
+    __atomic_store_n(&shm->flag, ++value, __ATOMIC_RELEASE);
+  }
+
+  _exit(0);
+}
@@ -0,0 +1,315 @@
+#include <assert.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "stats.h"
+#include "timer.h"
+#include "utils.h"
+
+#define NUM_TEST_ITERATIONS     10000
+#define MAX_CHANNELS            100000
+#define SLAB_READINGS           5
+
+#define POKE                    1
+#define POKE_EXIT               2
+
+/*
+ * Measures how the wakeup latency of a child blocked in epoll_wait() scales
+ * with the number of idle channels it is watching. The parent creates
+ * <channels> pipes or eventfds, the child registers all of them with one
+ * epoll instance, and each iteration the parent pokes a randomly chosen
+ * channel and times how long it takes the child to wake up, as in
+ * pipe-timer. Replies go back over a single pipe.
+ *
+ * For each channel count the test also reports the setup cost (creating the
+ * channels in the parent and registering them with epoll in the child), the
+ * change in kernel slab memory (system-wide, so only a rough guide) and the
+ * child's maximum RSS.
+ *
+ * Futex words in shared memory cannot be waited on with epoll, so they are
+ * not offered as a channel type.
+ */
+
+typedef struct {
+  uint64_t              epoll_setup_nanoseconds;
+  long                  max_rss_kilobytes;
+} shared_memory_t;
+
+typedef struct {
+  uint64_t              tick;
+  int                   channel;
+} poke_reply_msg_t;
+
+int run_channels(int channels, int iterations, shared_memory_t *shm);
+int child_process(int *poke_fds, int channels, int reply_fd,
+    shared_memory_t *shm);
+long read_slab_kilobytes(void);
+int logging_enabled = 0;
+test_args_t test_args = { .iterations = NUM_TEST_ITERATIONS };
+
+int
+main(int argc, char** argv)
+{
+  int                   rv = 0, channels;
+  shared_memory_t       *shm;
+  struct rlimit         limit;
+
+  timer_init();
+
+  rv = get_args(argc, argv, ARGS_SLEEP | ARGS_CHANNELS, &test_args);
+  if (rv != 0) {
+    exit(rv);
+  }
+  logging_enabled = test_args.logging;
+  channels = test_args.channels;
+
+  // Each pipe channel needs two descriptors; raise the soft limit as far as
+  // the hard limit allows.
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+    limit.rlim_cur = limit.rlim_max;
+    (void) setrlimit(RLIMIT_NOFILE, &limit);
+    (void) getrlimit(RLIMIT_NOFILE, &limit);
+  }
+
+  shm = (shared_memory_t*) create_shared_memory(sizeof (shared_memory_t));
+  if (shm == MAP_FAILED) {
+    LOG_ERR("create_shared_memory() failed\n");
+    exit(-1);
+  }
+
+  for (int c = channels ? channels : 1;
+       c <= (channels ? channels : MAX_CHANNELS); c *= 10) {
+    if ((rlim_t)c * 2 + 16 > limit.rlim_cur) {
+      LOG_ERR("%d channels exceed the open file limit of %ju\n",
+              c, (uintmax_t)limit.rlim_cur);
+      // a sweep just stops at the largest count that fits
+      rv = channels ? -1 : 0;
+      break;
+    }
+
+    rv = run_channels(c, test_args.iterations, shm);
+    if (rv != 0) {
+      break;
+    }
+  }
+
+  exit(rv);
+}
+
+int
+run_channels(int channels, int iterations, shared_memory_t *shm)
+{
+  int                   rv = 0, status;
+  int                   *rd_fds, *wr_fds, reply_pipe[2];
+  uint64_t              start, create_nanoseconds;
+  long                  slab_before, slab_after = 0;
+  pid_t                 fork_pid;
+  latency_stats_t       stats;
+
+  rd_fds = calloc(channels, sizeof (int));
+  wr_fds = calloc(channels, sizeof (int));
+  memset(shm, 0, sizeof (*shm));
+
+  if (pipe(reply_pipe) == -1) {
+    LOG_ERR("pipe() failed\n");
+    return -1;
+  }
+
+  slab_before = read_slab_kilobytes();
+  start = tick();
+  for (int i = 0; i < channels; i++) {
+    if (test_args.channel_kind == CHANNEL_EVENTFD) {
+      rd_fds[i] = wr_fds[i] = eventfd(0, 0);
+      rv = rd_fds[i] == -1 ? -1 : 0;
+    } else {
+      int fds[2];
+
+      rv = pipe(fds);
+      rd_fds[i] = fds[PIPE_RD_END];
+      wr_fds[i] = fds[PIPE_WR_END];
+    }
+    if (rv == -1) {
+      LOG_ERR("creating channel %d failed\n", i);
+      return -1;
+    }
+  }
+  create_nanoseconds = tick_delta_to_nanoseconds(tick() - start);
+
+  fork_pid = fork();
+  if (fork_pid == -1) {
+    LOG_ERR("fork() failed\n");
+    return -1;
+  } else if (fork_pid == 0) {
+    close(reply_pipe[PIPE_RD_END]);
+    _exit(child_process(rd_fds, channels, reply_pipe[PIPE_WR_END], shm));
+  }
+
+  close(reply_pipe[PIPE_WR_END]);
+  stats_init(&stats, 0, 0);
+
+  for (int i = 0; i <= iterations; i++) {
+    poke_reply_msg_t    poke_reply = {};
+    uint64_t            value = POKE, poke_start_time, delta;
+    int                 channel = random() % channels;
+
+    if (i == iterations) {
+      // we're done; the child still holds its epoll registrations, so take
+      // the memory reading before letting it exit
+      slab_after = read_slab_kilobytes();
+      value = POKE_EXIT;
+    } else if (test_args.sleep_microseconds) {
+      random_usleep(test_args.sleep_microseconds);
+    }
+
+    poke_start_time = tick();
+    rv = write_bytes(wr_fds[channel], sizeof (value), &value);
+    if (rv != 0 || value == POKE_EXIT) {
+      break;
+    }
+
+    rv = read_bytes(reply_pipe[PIPE_RD_END], sizeof (poke_reply), &poke_reply);
+    if (rv != 0) {
+      break;
+    }
+    assert(poke_reply.channel == channel);
+
+    delta = tick_delta_to_nanoseconds(poke_reply.tick - poke_start_time);
+    LOG("%" PRIu64 " nanoseconds\n", delta);
+    stats_record(&stats, delta);
+  }
+
+  if (waitpid(fork_pid, &status, 0) == -1 ||
+      !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    LOG_ERR("child failed\n");
+    rv = -1;
+  }
+
+  PRINT("%d %s channels: create %" PRIu64 " us, epoll registration %"
+        PRIu64 " us, slab %+ld kB, child max RSS %ld kB\n",
+        channels,
+        test_args.channel_kind == CHANNEL_EVENTFD ? "eventfd" : "pipe",
+        create_nanoseconds / 1000, shm->epoll_setup_nanoseconds / 1000,
+        slab_after - slab_before, shm->max_rss_kilobytes);
+  stats_print(&stats);
+
+  for (int i = 0; i < channels; i++) {
+    close(rd_fds[i]);
+    if (wr_fds[i] != rd_fds[i])
+      close(wr_fds[i]);
+  }
+  close(reply_pipe[PIPE_RD_END]);
+  free(rd_fds);
+  free(wr_fds);
+
+  return rv;
+}
+
+int
+child_process(int *poke_fds, int channels, int reply_fd, shared_memory_t *shm)
+{
+  int                   epoll_fd, rv = 0;
+  uint64_t              start;
+  struct rusage         usage;
+
+  start = tick();
+  epoll_fd = epoll_create1(0);
+  if (epoll_fd == -1) {
+    LOG_ERR("epoll_create1() failed\n");
+    return 1;
+  }
+
+  for (int i = 0; i < channels; i++) {
+    struct epoll_event event = {};
+
+    event.events = EPOLLIN;
+    event.data.u32 = i;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, poke_fds[i], &event) == -1) {
+      LOG_ERR("epoll_ctl() failed for channel %d\n", i);
+      return 1;
+    }
+  }
+  shm->epoll_setup_nanoseconds = tick_delta_to_nanoseconds(tick() - start);
+
+  while (1) {
+    struct epoll_event  event;
+    poke_reply_msg_t    poke_reply = {};
+    uint64_t            value;
+
+    rv = epoll_wait(epoll_fd, &event, 1, -1);
+    poke_reply.tick = tick();
+    if (rv != 1) {
+      LOG_ERR("%s: error: epoll_wait returned %d\n", __FUNCTION__, rv);
+      return 1;
+    }
+
+    poke_reply.channel = event.data.u32;
+    rv = read_bytes(poke_fds[poke_reply.channel], sizeof (value), &value);
+    if (rv != 0) {
+      return 1;
+    }
+
+    if (value == POKE_EXIT) {
+      break;
+    }
+
+    rv = write_bytes(reply_fd, sizeof (poke_reply), &poke_reply);
+    if (rv != 0) {
+      return 1;
+    }
+  }
+
+  if (getrusage(RUSAGE_SELF, &usage) == 0)
+    shm->max_rss_kilobytes = usage.ru_maxrss;
+
+  return 0;
+}
+
+static int
+compare_long(const void *a, const void *b)
+{
+  long x = *(const long *)a, y = *(const long *)b;
+
+  return (x > y) - (x < y);
+}
+
+// Returns the kernel slab size from /proc/meminfo, or 0 if it is unavailable.
+// The figure is system-wide, so it takes the median of several readings a
+// millisecond apart to filter out other activity on the machine.
+long
+read_slab_kilobytes(void)
+{
+  long readings[SLAB_READINGS];
+
+  for (int r = 0; r < SLAB_READINGS; r++) {
+    FILE *fp;
+    char line[128];
+
+    readings[r] = 0;
+    if (r > 0)
+      usleep(1000);
+
+    fp = fopen("/proc/meminfo", "r");
+    if (fp == NULL) {
+      return 0;
+    }
+    while (fgets(line, sizeof (line), fp) != NULL) {
+      if (sscanf(line, "Slab: %ld kB", &readings[r]) == 1)
+        break;
+    }
+    fclose(fp);
+  }
+
+  qsort(readings, SLAB_READINGS, sizeof (long), compare_long);
+
+  return readings[SLAB_READINGS / 2];
+}
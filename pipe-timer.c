@@ -11,47 +11,27 @@
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include "poke.h"
 #include "timer.h"
 #include "utils.h"
 
 #define NUM_TEST_ITERATIONS     1000
 
-#define MSG_POKE_READY          1
-#define MSG_POKE                2
-#define MSG_POKE_REPLY          3
-
 typedef struct {
   int                   send_fd;
   int                   recv_poke_fd;
   int                   child_should_exit;
+  int                   cpu;            // CPU to pin to with -C, or -1
 } child_state_t;
 
-typedef struct {
-  int                   send_poke_fd;
-  int                   recv_fd;
-  int                   iterations;
-} parent_state_t;
-
-typedef struct {
-  int                   type;
-} poke_ready_msg_t;
-
-typedef struct {
-  int                   type;
-  int                   child_should_exit;
-} poke_msg_t;
-
-typedef struct {
-  int                   type;
-  uint64_t              tick;
-} poke_reply_msg_t;
-
+int run_parent(parent_state_t *pstatep);
 int parent_process(parent_state_t *pstatep);
 int parent_do_poke_test(parent_state_t *pstate);
 void parent_do_shutdown(parent_state_t *pstatep);
 int child_process(child_state_t *cstatep);
+void* child_thread_func(void *data);
 int logging_enabled = 0;
-int random_sleep_microseconds = 0;
+test_args_t test_args = { .iterations = NUM_TEST_ITERATIONS };
 
 int
 main(int argc, char** argv)
@@ -59,73 +39,124 @@ main(int argc, char** argv)
   int           rv;
   int           pipe1[2], pipe2[2];
   pid_t         fork_pid;
-  char          option;
-  int           iterations = NUM_TEST_ITERATIONS;
+  child_state_t cstate = {};
+  parent_state_t pstate = {};
 
   timer_init();
 
   rv = get_args(argc, argv,
-      &random_sleep_microseconds,
-      &logging_enabled,
-      &iterations);
+      ARGS_COMMON | ARGS_OPEN_LOOP | ARGS_TRANSPORT, &test_args);
   if (rv != 0) {
     exit (rv);
   }
+  logging_enabled = test_args.logging;
 
-  rv = pipe(pipe1);
+  rv = create_channel(test_args.transport, test_args.busy_poll_microseconds,
+                      pipe1);
   if (rv == -1) {
-    LOG_ERR("pipe() failed\n");
+    LOG_ERR("create_channel() failed\n");
     exit(-1);
   }
-  rv = pipe(pipe2);
+  rv = create_channel(test_args.transport, test_args.busy_poll_microseconds,
+                      pipe2);
   if (rv == -1) {
-    LOG_ERR("pipe() failed\n");
+    LOG_ERR("create_channel() failed\n");
     exit(-1);
   }
 
+  // pipe1: parent->child (poke)
+  // pipe2: child->parent (poke reply)
+  // These are sockets rather than pipes if a transport was given with -x.
+  cstate.recv_poke_fd       = pipe1[PIPE_RD_END];
+  cstate.send_fd            = pipe2[PIPE_WR_END];
+
+  pstate.send_poke_fd       = pipe1[PIPE_WR_END];
+  pstate.recv_fd            = pipe2[PIPE_RD_END];
+  pstate.child_recv_poke_fd = pipe1[PIPE_RD_END];
+  pstate.iterations         = test_args.iterations;
+  stats_init(&pstate.stats,
+      (uint64_t)test_args.window_seconds * 1000000000,
+      test_args.threshold_nanoseconds);
+  pstate.deadline_tick      = stats_deadline_tick(&pstate.stats,
+                                                  test_args.duration_seconds);
+  if (test_args.sweep_microseconds) {
+    idle_sweep_init(&pstate.sweep, test_args.sweep_microseconds,
+        test_args.iterations, test_args.record_cpu_state);
+    pstate.iterations = idle_sweep_iterations(&pstate.sweep);
+  }
+  cstate.cpu = test_args.sweep_microseconds ? pstate.sweep.cpu : -1;
+
+  if (test_args.threads) {
+    pthread_t child_thread;
+
+    LOG("parent and child threads in PID: %d\n", getpid());
+
+    // The threads share a file descriptor table, so every pipe end stays
+    // open.
+    rv = pthread_create(&child_thread, NULL, child_thread_func, &cstate);
+    if (rv != 0) {
+      LOG_ERR("pthread_create() failed\n");
+      exit(-1);
+    }
+
+    rv = run_parent(&pstate);
+    (void) pthread_join(child_thread, NULL);
+
+    exit(rv);
+  }
+
   fork_pid = fork();
   if (fork_pid == -1) {
     LOG_ERR("fork() failed\n");
     rv = -1;
   } else if (fork_pid == 0) {
-    child_state_t cstate = {};
-
     LOG("child PID: %d\n", getpid());
 
-    // pipe1: parent->child (poke)
-    // pipe2: child->parent (poke reply)
     close(pipe1[PIPE_WR_END]);
     close(pipe2[PIPE_RD_END]);
 
-    cstate.recv_poke_fd = pipe1[PIPE_RD_END];
-    cstate.send_fd      = pipe2[PIPE_WR_END];
-
     rv = child_process(&cstate);
   } else {
-    parent_state_t pstate = {};
-
     LOG("parent PID: %d\n", getpid());
 
-    // pipe1: parent->child (poke)
-    // pipe2: child->parent (poke reply)
-    close(pipe1[PIPE_RD_END]);
+    // with udp the parent may have to shut down the child's socket to
+    // unblock it, see udp_wait_for_exit_ack()
+    if (test_args.transport != TRANSPORT_UDP)
+      close(pipe1[PIPE_RD_END]);
     close(pipe2[PIPE_WR_END]);
 
-    pstate.send_poke_fd       = pipe1[PIPE_WR_END];
-    pstate.recv_fd            = pipe2[PIPE_RD_END];
-    pstate.iterations         = iterations;
-
-    rv = parent_process(&pstate);
+    rv = run_parent(&pstate);
   }
 
   exit(rv);
 }
 
+int
+run_parent(parent_state_t *pstatep)
+{
+  if (test_args.rate)
+    return parent_process_open_loop(pstatep, &test_args);
+
+  return parent_process(pstatep);
+}
+
+void*
+child_thread_func(void *data)
+{
+  child_state_t *cstatep = (child_state_t *)data;
+
+  (void) child_process(cstatep);
+
+  return NULL;
+}
+
 int
 child_process(child_state_t *cstatep)
 {
   int rv;
 
+  idle_sweep_pin_child(cstatep->cpu);
+
   while (1) {
     poke_msg_t          poke_msg = {};
     poke_reply_msg_t    poke_reply = {};
@@ -140,10 +171,17 @@ child_process(child_state_t *cstatep)
     assert(poke_msg.type == MSG_POKE);
 
     if (poke_msg.child_should_exit) {
+      // in open-loop mode the parent's reply thread needs to know that
+      // every reply has been sent
+      if (test_args.rate) {
+        poke_reply.type = MSG_EXIT_ACK;
+        rv = write_bytes(cstatep->send_fd, sizeof (poke_reply), &poke_reply);
+      }
       break;
     }
 
     poke_reply.type = MSG_POKE_REPLY;
+    poke_reply.poke_tick = poke_msg.tick;
     rv = write_bytes(cstatep->send_fd, sizeof (poke_reply), &poke_reply);
     if (rv != 0) {
       break;
@@ -157,25 +195,26 @@ int
 parent_process(parent_state_t *pstatep)
 {
   int                   rv;
-  uint64_t              total_delta = 0, min_delta = UINT64_MAX, max_delta = 0;
 
   for (int i = 0; i <= pstatep->iterations; i++) {
     poke_msg_t          poke = {};
     poke_reply_msg_t    poke_reply = {};
     uint64_t            poke_start_time, delta;
 
-    if (i == pstatep->iterations) {
+    if (i == pstatep->iterations || deadline_passed(pstatep->deadline_tick)) {
       // we're done
       poke.child_should_exit = 1;
     }
 
-    if (random_sleep_microseconds)
-      random_usleep(random_sleep_microseconds);
+    if (test_args.sweep_microseconds)
+      idle_sweep_pause(&pstatep->sweep);
+    else if (test_args.sleep_microseconds)
+      random_usleep(test_args.sleep_microseconds);
 
     poke.type = MSG_POKE;
     poke_start_time = tick();
     rv = write_bytes(pstatep->send_poke_fd, sizeof (poke), &poke);
-    if (rv != 0 || i == pstatep->iterations) {
+    if (rv != 0 || poke.child_should_exit) {
       break;
     }
 
@@ -186,20 +225,12 @@ parent_process(parent_state_t *pstatep)
 
     delta = tick_delta_to_nanoseconds(poke_reply.tick - poke_start_time);
     LOG("%" PRIu64 " nanoseconds\n", delta);
-
-    total_delta += delta;
-    if (delta < min_delta)
-      min_delta = delta;
-    if (delta > max_delta)
-      max_delta = delta;
+    stats_record(&pstatep->stats, delta);
+    if (test_args.sweep_microseconds)
+      idle_sweep_record(&pstatep->sweep, delta);
   }
 
-  PRINT("average over %d iterations: %" PRIu64 " nanoseconds\n",
-      pstatep->iterations, total_delta / pstatep->iterations);
-  PRINT("    max over %d iterations: %" PRIu64 " nanoseconds\n",
-      pstatep->iterations, max_delta);
-  PRINT("    min over %d iterations: %" PRIu64 " nanoseconds\n",
-      pstatep->iterations, min_delta);
+  stats_print(&pstatep->stats);
 
   return rv;
 }
@@ -0,0 +1,126 @@
+#include <assert.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "poke.h"
+#include "timer.h"
+#include "utils.h"
+
+// defined by each test, and used by LOG()
+extern int logging_enabled;
+
+/*
+ * Open-loop variant of the tests' parent_process(). Pokes are sent on a fixed
+ * schedule (constant or Poisson inter-arrival times) without waiting for the
+ * previous reply, and a separate thread collects the replies. Latency is
+ * measured from the time the poke was scheduled to be sent rather than the
+ * time it was actually written, so a poke that is delayed because the child
+ * or the channel is backed up is charged for the delay instead of silently
+ * being omitted. The child skips the MSG_POKE_READY handshake in this mode,
+ * so the only messages on recv_fd are poke replies and the final
+ * MSG_EXIT_ACK.
+ */
+static void*
+parent_recv_reply_thread_func(void *data)
+{
+  parent_state_t *pstatep = (parent_state_t *)data;
+
+  while (1) {
+    poke_reply_msg_t    poke_reply = {};
+    uint64_t            delta;
+    int                 rv;
+
+    rv = read_bytes(pstatep->recv_fd, sizeof (poke_reply), &poke_reply);
+    if (rv != 0 || poke_reply.type == MSG_EXIT_ACK) {
+      break;
+    }
+    assert(poke_reply.type == MSG_POKE_REPLY);
+
+    delta = tick_delta_to_nanoseconds(poke_reply.tick - poke_reply.poke_tick);
+    LOG("%" PRIu64 " nanoseconds\n", delta);
+    stats_record(&pstatep->stats, delta);
+  }
+
+  pstatep->reply_thread_done = 1;
+
+  return NULL;
+}
+
+// UDP can drop the exit poke or its ack as well as ordinary pokes and
+// replies. Resends the exit poke until the reply thread has seen the ack, and
+// if it never does, shuts down the reply socket and the child's poke socket,
+// so that neither the reply thread nor the child waits forever.
+static void
+udp_wait_for_exit_ack(parent_state_t *pstatep)
+{
+  poke_msg_t poke = { .type = MSG_POKE, .child_should_exit = 1 };
+
+  for (int ms = 1; ms <= 1000 && !pstatep->reply_thread_done; ms++) {
+    usleep(1000);
+    if (ms % 100 == 0 && !pstatep->reply_thread_done)
+      (void) write_bytes(pstatep->send_poke_fd, sizeof (poke), &poke);
+  }
+
+  if (!pstatep->reply_thread_done) {
+    LOG_ERR("no exit ack from the child\n");
+    (void) shutdown(pstatep->recv_fd, SHUT_RDWR);
+    (void) shutdown(pstatep->child_recv_poke_fd, SHUT_RD);
+  }
+}
+
+int
+parent_process_open_loop(parent_state_t *pstatep, test_args_t *argsp)
+{
+  int                   rv, pokes_sent = 0;
+  pthread_t             recv_thread;
+  uint64_t              poke_tick;
+
+  PRINT("offered load: %d pokes per second, %s inter-arrival times\n",
+      argsp->rate, argsp->poisson ? "Poisson" : "constant");
+
+  rv = pthread_create(&recv_thread, NULL,
+                      parent_recv_reply_thread_func, pstatep);
+  if (rv != 0) {
+    LOG_ERR("parent_process_open_loop: pthread_create() failed\n");
+    return rv;
+  }
+
+  poke_tick = tick();
+  for (int i = 0; i <= pstatep->iterations; i++) {
+    poke_msg_t          poke = {};
+
+    if (i == pstatep->iterations || deadline_passed(pstatep->deadline_tick)) {
+      // we're done
+      poke.child_should_exit = 1;
+    } else {
+      poke_tick += nanoseconds_to_tick_delta(next_arrival_nanoseconds(argsp));
+      wait_until_tick(poke_tick);
+    }
+
+    poke.type = MSG_POKE;
+    poke.tick = poke_tick;
+    rv = write_bytes(pstatep->send_poke_fd, sizeof (poke), &poke);
+    if (rv != 0 || poke.child_should_exit) {
+      break;
+    }
+    pokes_sent++;
+  }
+
+  if (argsp->transport == TRANSPORT_UDP)
+    udp_wait_for_exit_ack(pstatep);
+
+  (void) pthread_join(recv_thread, NULL);
+
+  stats_print(&pstatep->stats);
+  if (argsp->transport == TRANSPORT_UDP) {
+    uint64_t lost = pokes_sent - pstatep->stats.all.count;
+
+    PRINT("lost %" PRIu64 " of %d pokes or replies (%.2f%%)\n", lost,
+        pokes_sent, pokes_sent ? lost * 100.0 / pokes_sent : 0.0);
+  }
+
+  return rv;
+}
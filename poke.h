@@ -0,0 +1,49 @@
+#ifndef POKE_H
+#define POKE_H
+
+#include <stdint.h>
+
+#include "stats.h"
+#include "sweep.h"
+#include "utils.h"
+
+/*
+ * Messages and parent state shared by pipe-timer and pipe-signal-timer, which
+ * poke a child over a pair of channels and time its reply.
+ */
+
+#define MSG_POKE_READY          1
+#define MSG_POKE                2
+#define MSG_POKE_REPLY          3
+#define MSG_EXIT_ACK            4
+
+typedef struct {
+  int                   send_poke_fd;
+  int                   recv_fd;
+  int                   child_recv_poke_fd;     // see udp_wait_for_exit_ack()
+  int                   iterations;
+  uint64_t              deadline_tick;
+  latency_stats_t       stats;
+  idle_sweep_t          sweep;
+  volatile int          reply_thread_done;
+} parent_state_t;
+
+typedef struct {
+  int                   type;
+} poke_ready_msg_t;
+
+typedef struct {
+  int                   type;
+  int                   child_should_exit;
+  uint64_t              tick;           // intended send time (open-loop)
+} poke_msg_t;
+
+typedef struct {
+  int                   type;
+  uint64_t              tick;
+  uint64_t              poke_tick;      // echoed from poke_msg_t
+} poke_reply_msg_t;
+
+int parent_process_open_loop(parent_state_t *pstatep, test_args_t *argsp);
+
+#endif
@@ -1,3 +1,7 @@
+#if defined(LINUX)
+#define _GNU_SOURCE
+#endif
+
 #include <assert.h>
 #include <ctype.h>
 #include <inttypes.h>
@@ -6,12 +10,16 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sched.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/types.h>
 #include <sys/uio.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include "stats.h"
+#include "sweep.h"
 #include "timer.h"
 #include "utils.h"
 
@@ -49,6 +57,16 @@
  *     set timestamp_child_acquire=tick();
  *     exit A
  *     exit B
+ *
+ * With -n or -N the child spins before it blocks on A: it polls the shared
+ * timestamps, which the parent updates just before it releases A, tries A
+ * once they show a new release, and falls back to pthread_mutex_lock() after
+ * the given number of polls. -N sweeps the spin count over 0, 1, 10, 100, ...
+ * and reports, for each count, the latency, the child's CPU time per wakeup
+ * and how often it still had to block. The CPU time is a getrusage() delta
+ * taken around the wait in child_lock() that ended in the wakeup, so that it
+ * leaves out the rest of the loop; the child accumulates it in the shared
+ * memory.
  */
 
 typedef struct {
@@ -57,12 +75,34 @@ typedef struct {
   volatile uint64_t     timestamp_parent_release;
   volatile uint64_t     timestamp_child_acquire;
   volatile int          child_should_exit;
+  volatile int          spin_iterations;
+  volatile uint64_t     child_cpu_nanoseconds;  // in waits that woke up
+  volatile uint64_t     child_blocked;
 } shared_memory_t;
 
+/*
+ * Sweep over the child's spin count. Each count gets |iterations_per_bucket|
+ * samples, measured against the child's CPU time and block count at the start
+ * of the bucket.
+ */
+typedef struct {
+  int                   spins;
+  int                   max_spins;
+  int                   iterations_per_bucket;
+  int                   skip_sample;
+  latency_stats_t       stats;
+  uint64_t              cpu_nanoseconds;
+  uint64_t              blocked;
+} spin_sweep_t;
+
 int child_process(shared_memory_t *shm);
+void* child_thread_func(void *data);
 int parent_process(shared_memory_t *shm, int iterations);
 int logging_enabled = 0;
-int random_sleep_microseconds = 0;
+test_args_t test_args = { .iterations = NUM_TEST_ITERATIONS };
+
+// Set up before the fork so that the child knows which CPU to pin to with -C.
+idle_sweep_t sweep = { .cpu = -1 };
 
 int
 main(int argc, char** argv)
@@ -71,27 +111,49 @@ main(int argc, char** argv)
   pid_t                 fork_pid;
   shared_memory_t       *shm;
   pthread_mutexattr_t   attr = {};
-  char                  option;
-  int                   iterations = NUM_TEST_ITERATIONS;
 
   timer_init();
 
-  rv = get_args(argc, argv,
-      &random_sleep_microseconds,
-      &logging_enabled,
-      &iterations);
+  rv = get_args(argc, argv, ARGS_COMMON | ARGS_SPIN, &test_args);
   if (rv != 0) {
     exit (rv);
   }
+  logging_enabled = test_args.logging;
 
   shm = (shared_memory_t*) create_shared_memory(sizeof (shared_memory_t));
   bzero(shm, sizeof (shared_memory_t));
+  shm->spin_iterations = test_args.spin_iterations;
 
+  // In thread mode the mutexes are process-private, which lets them use
+  // private futexes.
   rv = pthread_mutexattr_init(&attr);
-  rv = pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+  if (!test_args.threads)
+    rv = pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
   rv = pthread_mutex_init(&shm->a, &attr);
   rv = pthread_mutex_init(&shm->b, &attr);
 
+  if (test_args.sweep_microseconds) {
+    idle_sweep_init(&sweep, test_args.sweep_microseconds,
+        test_args.iterations, test_args.record_cpu_state);
+  }
+
+  if (test_args.threads) {
+    pthread_t child_thread;
+
+    LOG("parent and child threads in PID: %d\n", getpid());
+
+    rv = pthread_create(&child_thread, NULL, child_thread_func, shm);
+    if (rv != 0) {
+      LOG_ERR("pthread_create() failed\n");
+      exit(-1);
+    }
+
+    rv = parent_process(shm, test_args.iterations);
+    (void) pthread_join(child_thread, NULL);
+
+    exit(rv);
+  }
+
   fork_pid = fork();
   if (fork_pid == -1) {
     LOG_ERR("fork() failed\n");
@@ -101,32 +163,106 @@ main(int argc, char** argv)
     rv = child_process(shm);
   } else {
     LOG("parent PID: %d\n", getpid());
-    rv = parent_process(shm, iterations);
+    rv = parent_process(shm, test_args.iterations);
   }
 
   exit(rv);
 }
 
+static int
+spin_sweep_iterations(spin_sweep_t *sweepp)
+{
+  int buckets = 1;
+
+  for (int spins = 1; spins <= sweepp->max_spins; spins *= 10)
+    buckets++;
+
+  // one skipped sample per bucket
+  return buckets * (sweepp->iterations_per_bucket + 1);
+}
+
+// Prints the CPU time and block rate of the child over |count| wakeups.
+static void
+print_child_cpu(uint64_t cpu_nanoseconds, uint64_t blocked, uint64_t count)
+{
+  PRINT("child CPU %" PRIu64 " nanoseconds per wakeup, %" PRIu64
+      "%% blocked\n", cpu_nanoseconds / count, blocked * 100 / count);
+}
+
+// Records one sample while the parent holds A, and moves the child on to the
+// next spin count once the current one has enough samples.
+static void
+spin_sweep_record(spin_sweep_t *sweepp, shared_memory_t *shm,
+    uint64_t nanoseconds)
+{
+  histogram_t *histp = &sweepp->stats.all;
+
+  // The first sample after a change was already waited for with the old
+  // spin count, and the first sample of all sets the CPU time baseline.
+  if (sweepp->skip_sample) {
+    sweepp->skip_sample = 0;
+    sweepp->cpu_nanoseconds = shm->child_cpu_nanoseconds;
+    sweepp->blocked = shm->child_blocked;
+    return;
+  }
+
+  stats_record(&sweepp->stats, nanoseconds);
+  if (histp->count < sweepp->iterations_per_bucket) {
+    return;
+  }
+
+  PRINT("spin %7d: average %" PRIu64 ", p50 %" PRIu64 ", p99 %" PRIu64
+      ", max %" PRIu64 " nanoseconds, ", sweepp->spins,
+      histp->total / histp->count, stats_percentile(histp, 50.0),
+      stats_percentile(histp, 99.0), histp->max);
+  print_child_cpu(shm->child_cpu_nanoseconds - sweepp->cpu_nanoseconds,
+      shm->child_blocked - sweepp->blocked, histp->count);
+
+  sweepp->spins = sweepp->spins ? sweepp->spins * 10 : 1;
+  shm->spin_iterations = sweepp->spins;
+  sweepp->skip_sample = 1;
+  stats_init(&sweepp->stats, 0, 0);
+}
+
 int
 parent_process(shared_memory_t *shm, int iterations)
 {
   pthread_mutex_t *a, *b;
   int i = 0;
-  uint64_t total_delta = 0, min_delta = UINT64_MAX, max_delta = 0;
+  latency_stats_t stats;
+  spin_sweep_t spin_sweep = {};
+  uint64_t deadline_tick;
+  uint64_t first_cpu_nanoseconds = 0, first_blocked = 0;
+  uint64_t last_cpu_nanoseconds = 0, last_blocked = 0;
 
   a = &shm->a;
   b = &shm->b;
 
+  stats_init(&stats, (uint64_t)test_args.window_seconds * 1000000000,
+      test_args.threshold_nanoseconds);
+  deadline_tick = stats_deadline_tick(&stats, test_args.duration_seconds);
+  if (test_args.sweep_microseconds) {
+    iterations = idle_sweep_iterations(&sweep);
+  } else if (test_args.spin_sweep_max) {
+    spin_sweep.max_spins = test_args.spin_sweep_max;
+    spin_sweep.iterations_per_bucket = iterations;
+    spin_sweep.skip_sample = 1;
+    stats_init(&spin_sweep.stats, 0, 0);
+    iterations = spin_sweep_iterations(&spin_sweep);
+  }
+
   pthread_mutex_lock(b);
 
-  while (i < iterations) {
+  while (i < iterations && !deadline_passed(deadline_tick)) {
     uint64_t delta;
 
     pthread_mutex_lock(a);
     pthread_mutex_unlock(b);
 
-    if (random_sleep_microseconds)
-      random_usleep(random_sleep_microseconds);
+    if (test_args.sweep_microseconds)
+      idle_sweep_pause(&sweep);
+    else if (test_args.sleep_microseconds)
+      random_usleep(test_args.sleep_microseconds);
 
     if (shm->timestamp_parent_release == 0 &&
         shm->timestamp_child_acquire == 0) {
@@ -137,11 +273,17 @@ parent_process(shared_memory_t *shm, int iterations)
     } else if (shm->timestamp_child_acquire) {
       delta = tick_delta_to_nanoseconds(shm->timestamp_child_acquire -
                                         shm->timestamp_parent_release);
-      total_delta += delta;
-      if (delta < min_delta)
-        min_delta = delta;
-      if (delta > max_delta)
-        max_delta = delta;
+      stats_record(&stats, delta);
+      if (test_args.sweep_microseconds)
+        idle_sweep_record(&sweep, delta);
+      else if (test_args.spin_sweep_max)
+        spin_sweep_record(&spin_sweep, shm, delta);
+      if (i == 0) {
+        first_cpu_nanoseconds = shm->child_cpu_nanoseconds;
+        first_blocked = shm->child_blocked;
+      }
+      last_cpu_nanoseconds = shm->child_cpu_nanoseconds;
+      last_blocked = shm->child_blocked;
       LOG("%" PRIu64 " nanoseconds\n", delta);
       i++;
       shm->timestamp_child_acquire = 0;
@@ -163,27 +305,85 @@ parent_process(shared_memory_t *shm, int iterations)
   shm->child_should_exit = 1;
   pthread_mutex_unlock(a);
 
-  PRINT("average over %d iterations: %" PRIu64 " nanoseconds\n",
-      iterations, total_delta / iterations);
-  PRINT("    max over %d iterations: %" PRIu64 " nanoseconds\n",
-      iterations, max_delta);
-  PRINT("    min over %d iterations: %" PRIu64 " nanoseconds\n",
-      iterations, min_delta);
+  stats_print(&stats);
+  if (test_args.spin_iterations && i > 1)
+    print_child_cpu(last_cpu_nanoseconds - first_cpu_nanoseconds,
+        last_blocked - first_blocked, i - 1);
 
   return 0;
 }
 
+// Returns the CPU time used so far by the child. On Linux this covers just
+// the calling thread, so that it is also correct with -T.
+static uint64_t
+child_cpu_nanoseconds(void)
+{
+  struct rusage usage;
+
+#if defined(LINUX)
+  if (getrusage(RUSAGE_THREAD, &usage) == -1)
+#else
+  if (getrusage(RUSAGE_SELF, &usage) == -1)
+#endif
+    return 0;
+
+  return (uint64_t)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) *
+         1000000000 +
+         (uint64_t)(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1000;
+}
+
+// Takes A, spinning for up to |spins| polls first, and returns 1 if the child
+// found A still held after spinning and had to block. A is tried on the first
+// poll, in case the parent is not holding it, and after that only once the
+// timestamps show that the parent has published a new release or wants the
+// child to exit, so the spinning child mostly reads the shared cache line
+// rather than writing the mutex.
+static int
+child_lock(shared_memory_t *shm, int spins)
+{
+  for (int n = 0; n < spins; n++) {
+    if ((n == 0 || shm->child_should_exit ||
+         (shm->timestamp_child_acquire == 0 &&
+          shm->timestamp_parent_release != 0)) &&
+        pthread_mutex_trylock(&shm->a) == 0) {
+      return 0;
+    }
+
+    if (test_args.spin_yield)
+      sched_yield();
+    else
+      cpu_relax();
+  }
+
+  if (pthread_mutex_trylock(&shm->a) == 0)
+    return 0;
+  pthread_mutex_lock(&shm->a);
+
+  return 1;
+}
+
 int
 child_process(shared_memory_t *shm)
 {
   pthread_mutex_t *a, *b;
+  int measure_cpu = test_args.spin_iterations || test_args.spin_sweep_max;
+  int blocked;
+  uint64_t wait_start = 0, wait_end = 0, acquire_tick;
 
   a = &shm->a;
   b = &shm->b;
 
+  idle_sweep_pin_child(sweep.cpu);
+
   while (1) {
     pthread_mutex_lock(b);
-    pthread_mutex_lock(a);
+    if (measure_cpu)
+      wait_start = child_cpu_nanoseconds();
+    blocked = child_lock(shm, shm->spin_iterations);
+    // take the wakeup tick first so that the getrusage() call is not timed
+    acquire_tick = tick();
+    if (measure_cpu)
+      wait_end = child_cpu_nanoseconds();
 
     if (shm->child_should_exit) {
       pthread_mutex_unlock(a);
@@ -192,10 +392,20 @@ child_process(shared_memory_t *shm)
     }
 
     if (!shm->timestamp_child_acquire && shm->timestamp_parent_release) {
-      shm->timestamp_child_acquire = tick();
+      shm->timestamp_child_acquire = acquire_tick;
+      shm->child_blocked += blocked;
+      shm->child_cpu_nanoseconds += wait_end - wait_start;
     }
 
     pthread_mutex_unlock(a);
     pthread_mutex_unlock(b);
   }
 }
+
+void*
+child_thread_func(void *data)
+{
+  (void) child_process((shared_memory_t *)data);
+
+  return NULL;
+}
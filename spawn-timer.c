@@ -0,0 +1,310 @@
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#if defined(LINUX)
+#include <linux/sched.h>
+#include <sys/syscall.h>
+#endif
+
+#include "stats.h"
+#include "timer.h"
+#include "utils.h"
+
+#define NUM_TEST_ITERATIONS     100
+#define MEGABYTE                (1024 * 1024)
+#define CHILD_STACK_SIZE        (64 * 1024)
+
+// argv[1] of a posix_spawn()ed copy of this program; argv[2] is the fd to
+// report its start tick on.
+#define SPAWNED_ARG             "--spawned"
+
+/*
+ * Measures the time from a parent calling fork(), vfork(), posix_spawn(),
+ * clone3(CLONE_VM) or pthread_create() to the first instruction of the new
+ * child. The child records tick() as the first thing it does and hands the
+ * value back through shared memory (or, for posix_spawn(), which execs a new
+ * copy of this program, through a pipe).
+ *
+ * Each method is run against a parent with a range of resident memory sizes,
+ * touched page by page, so that the cost of copying page tables in fork()
+ * shows up against the methods that share or replace the address space.
+ */
+
+typedef struct {
+  volatile uint64_t     child_tick;
+} shared_memory_t;
+
+typedef int (*spawn_func_t)(shared_memory_t *shm, char *self);
+
+int spawn_fork(shared_memory_t *shm, char *self);
+int spawn_vfork(shared_memory_t *shm, char *self);
+int spawn_posix_spawn(shared_memory_t *shm, char *self);
+int spawn_clone3(shared_memory_t *shm, char *self);
+int spawn_pthread(shared_memory_t *shm, char *self);
+int logging_enabled = 0;
+test_args_t test_args = { .iterations = NUM_TEST_ITERATIONS,
+                          .megabytes = -1 };
+
+struct {
+  const char            *name;
+  spawn_func_t          func;
+} spawn_methods[] = {
+  { "fork",             spawn_fork },
+  { "vfork",            spawn_vfork },
+  { "posix_spawn",      spawn_posix_spawn },
+#if defined(LINUX) && defined(SYS_clone3) && defined(__x86_64__)
+  { "clone3(CLONE_VM)", spawn_clone3 },
+#endif
+  { "pthread_create",   spawn_pthread },
+};
+
+int
+main(int argc, char** argv)
+{
+  // must be the first thing a posix_spawn()ed child does
+  uint64_t              start_tick = tick();
+  int                   rv = 0, iterations, megabytes;
+  static const int      sweep_megabytes[] = { 0, 16, 64, 256, 1024 };
+  shared_memory_t       *shm;
+
+  if (argc == 3 && strcmp(argv[1], SPAWNED_ARG) == 0) {
+    _exit(write_bytes(atoi(argv[2]), sizeof (start_tick), &start_tick));
+  }
+
+  timer_init();
+
+  rv = get_args(argc, argv, ARGS_SPAWN, &test_args);
+  if (rv != 0) {
+    exit(rv);
+  }
+  logging_enabled = test_args.logging;
+  iterations = test_args.iterations;
+  megabytes = test_args.megabytes;
+
+  shm = (shared_memory_t*) create_shared_memory(sizeof (shared_memory_t));
+  if (shm == MAP_FAILED) {
+    LOG_ERR("create_shared_memory() failed\n");
+    exit(-1);
+  }
+
+  for (int s = 0; s < sizeof (sweep_megabytes) / sizeof (int); s++) {
+    size_t resident_size;
+    char *resident = NULL;
+
+    if (megabytes >= 0 && s > 0)
+      break;
+    resident_size = (size_t)(megabytes >= 0 ? megabytes : sweep_megabytes[s]) *
+                    MEGABYTE;
+
+    if (resident_size) {
+      resident = mmap(NULL, resident_size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANON, -1, 0);
+      if (resident == MAP_FAILED) {
+        LOG_ERR("mmap() of %zu MB failed\n", resident_size / MEGABYTE);
+        exit(-1);
+      }
+      memset(resident, 1, resident_size);
+    }
+
+    PRINT("parent resident memory +%zu MB:\n", resident_size / MEGABYTE);
+
+    for (int m = 0; m < sizeof (spawn_methods) / sizeof (spawn_methods[0]);
+         m++) {
+      latency_stats_t stats;
+      histogram_t *histp = &stats.all;
+
+      stats_init(&stats, 0, 0);
+      for (int i = 0; i < iterations; i++) {
+        uint64_t start, delta;
+
+        shm->child_tick = 0;
+        start = tick();
+        rv = spawn_methods[m].func(shm, argv[0]);
+        if (rv != 0) {
+          LOG_ERR("%s failed\n", spawn_methods[m].name);
+          break;
+        }
+
+        delta = tick_delta_to_nanoseconds(shm->child_tick - start);
+        LOG("%s: %" PRIu64 " nanoseconds\n", spawn_methods[m].name, delta);
+        stats_record(&stats, delta);
+      }
+
+      if (histp->count) {
+        PRINT("  %-18s average %" PRIu64 ", p50 %" PRIu64 ", p99 %" PRIu64
+            ", max %" PRIu64 " nanoseconds\n", spawn_methods[m].name,
+            histp->total / histp->count, stats_percentile(histp, 50.0),
+            stats_percentile(histp, 99.0), histp->max);
+      }
+    }
+
+    if (resident)
+      munmap(resident, resident_size);
+  }
+
+  exit(0);
+}
+
+// Reaps |pid|. Returns 0 if it exited successfully.
+static int
+reap(pid_t pid)
+{
+  int status;
+
+  if (waitpid(pid, &status, 0) == -1 ||
+      !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    return -1;
+  }
+
+  return 0;
+}
+
+int
+spawn_fork(shared_memory_t *shm, char *self)
+{
+  pid_t pid = fork();
+
+  if (pid == 0) {
+    shm->child_tick = tick();
+    _exit(0);
+  } else if (pid == -1) {
+    return -1;
+  }
+
+  return reap(pid);
+}
+
+int
+spawn_vfork(shared_memory_t *shm, char *self)
+{
+  pid_t pid = vfork();
+
+  if (pid == 0) {
+    shm->child_tick = tick();
+    _exit(0);
+  } else if (pid == -1) {
+    return -1;
+  }
+
+  return reap(pid);
+}
+
+int
+spawn_posix_spawn(shared_memory_t *shm, char *self)
+{
+  extern char           **environ;
+  int                   tick_pipe[2], rv;
+  char                  fd_arg[16];
+  char                  *child_argv[] = { self, SPAWNED_ARG, fd_arg, NULL };
+  pid_t                 pid;
+  uint64_t              child_tick;
+
+  if (pipe(tick_pipe) == -1) {
+    return -1;
+  }
+  snprintf(fd_arg, sizeof (fd_arg), "%d", tick_pipe[PIPE_WR_END]);
+
+  rv = posix_spawn(&pid, self, NULL, NULL, child_argv, environ);
+  close(tick_pipe[PIPE_WR_END]);
+  if (rv == 0) {
+    rv = read_bytes(tick_pipe[PIPE_RD_END], sizeof (child_tick), &child_tick);
+    if (reap(pid) != 0)
+      rv = -1;
+  }
+  close(tick_pipe[PIPE_RD_END]);
+
+  if (rv == 0)
+    shm->child_tick = child_tick;
+
+  return rv == 0 ? 0 : -1;
+}
+
+#if defined(LINUX) && defined(SYS_clone3) && defined(__x86_64__)
+static shared_memory_t *clone_shm;
+
+static void
+clone3_child(void)
+{
+  clone_shm->child_tick = tick();
+}
+
+/*
+ * glibc has no clone3() wrapper, and a raw syscall() cannot be used because
+ * the child would return from it on a fresh, empty stack. Like glibc's own
+ * clone(), the child calls straight into clone3_child() from the assembly
+ * that made the system call and then exits.
+ */
+int
+spawn_clone3(shared_memory_t *shm, char *self)
+{
+  static char           *stack;
+  struct clone_args     args;
+  long                  pid;
+
+  if (stack == NULL) {
+    stack = malloc(CHILD_STACK_SIZE);
+    if (stack == NULL) {
+      return -1;
+    }
+  }
+
+  clone_shm = shm;
+  memset(&args, 0, sizeof (args));
+  args.flags = CLONE_VM;
+  args.exit_signal = SIGCHLD;
+  args.stack = (uintptr_t)stack;
+  args.stack_size = CHILD_STACK_SIZE;
+
+  __asm__ __volatile__(
+    "syscall\n"
+    "test %%rax, %%rax\n"
+    "jnz 1f\n"
+    "xor %%ebp, %%ebp\n"
+    "call *%[child]\n"
+    "mov %[exit], %%eax\n"
+    "xor %%edi, %%edi\n"
+    "syscall\n"
+    "1:\n"
+    : "=a" (pid)
+    : "0" ((long)SYS_clone3), "D" (&args), "S" (sizeof (args)),
+      [child] "r" (clone3_child), [exit] "i" (SYS_exit)
+    : "rcx", "r11", "memory");
+
+  if (pid < 0) {
+    return -1;
+  }
+
+  return reap(pid);
+}
+#endif
+
+void*
+pthread_child(void *data)
+{
+  shared_memory_t *shm = (shared_memory_t *)data;
+
+  shm->child_tick = tick();
+
+  return NULL;
+}
+
+int
+spawn_pthread(shared_memory_t *shm, char *self)
+{
+  pthread_t thread;
+
+  if (pthread_create(&thread, NULL, pthread_child, shm) != 0) {
+    return -1;
+  }
+
+  return pthread_join(thread, NULL);
+}
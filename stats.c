@@ -0,0 +1,267 @@
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "stats.h"
+#include "timer.h"
+#include "utils.h"
+
+static int
+bucket_index(uint64_t value)
+{
+  int msb;
+
+  if (value < STATS_SUB_BUCKETS) {
+    return value;
+  }
+
+  msb = 63 - __builtin_clzll(value);
+  return (msb - STATS_SUB_BUCKET_BITS + 1) * STATS_SUB_BUCKETS +
+         (value >> (msb - STATS_SUB_BUCKET_BITS)) - STATS_SUB_BUCKETS;
+}
+
+// Returns the largest value that is recorded in bucket |index|.
+static uint64_t
+bucket_upper_bound(int index)
+{
+  int group = index / STATS_SUB_BUCKETS;
+  uint64_t sub = index % STATS_SUB_BUCKETS;
+
+  if (group == 0) {
+    return index;
+  }
+
+  return (((STATS_SUB_BUCKETS + sub + 1) << (group - 1)) - 1);
+}
+
+static void
+histogram_reset(histogram_t *histp)
+{
+  memset(histp, 0, sizeof (*histp));
+  histp->min = UINT64_MAX;
+}
+
+static void
+histogram_record(histogram_t *histp, uint64_t nanoseconds,
+    uint64_t threshold_nanoseconds)
+{
+  histp->count++;
+  histp->total += nanoseconds;
+  if (nanoseconds < histp->min)
+    histp->min = nanoseconds;
+  if (nanoseconds > histp->max)
+    histp->max = nanoseconds;
+  if (threshold_nanoseconds && nanoseconds > threshold_nanoseconds)
+    histp->over_threshold++;
+  histp->buckets[bucket_index(nanoseconds)]++;
+}
+
+// Prints the window that ends at |end_tick|. A |partial| window is the
+// remainder after the last boundary, which can be too short for a rate.
+static void
+window_print(latency_stats_t *statsp, uint64_t end_tick, int partial)
+{
+  histogram_t *histp = &statsp->window;
+  double elapsed, length;
+
+  elapsed = tick_delta_to_nanoseconds(end_tick - statsp->start_tick) / 1e9;
+  length = tick_delta_to_nanoseconds(end_tick - statsp->window_start_tick) /
+           1e9;
+
+  if (histp->count == 0) {
+    PRINT("[%9.1f s] no samples\n", elapsed);
+    return;
+  }
+
+  if (partial)
+    PRINT("[%9.1f s] %" PRIu64 " samples in the last %.3f s", elapsed,
+        histp->count, length);
+  else
+    PRINT("[%9.1f s] %" PRIu64 " samples, %.0f/s", elapsed, histp->count,
+        histp->count / length);
+  PRINT(", p50 %" PRIu64 ", p99 %" PRIu64 ", max %" PRIu64 " nanoseconds",
+      stats_percentile(histp, 50.0), stats_percentile(histp, 99.0),
+      histp->max);
+  if (statsp->threshold_nanoseconds) {
+    PRINT(", %" PRIu64 " over %" PRIu64,
+        histp->over_threshold, statsp->threshold_nanoseconds);
+  }
+  PRINT("\n");
+}
+
+// Prints and resets every window that has ended by |now|, including empty
+// ones, so that the windows stay on fixed boundaries. Called with the lock
+// held.
+static void
+window_advance(latency_stats_t *statsp, uint64_t now)
+{
+  while (now - statsp->window_start_tick >= statsp->window_ticks) {
+    uint64_t end_tick = statsp->window_start_tick + statsp->window_ticks;
+
+    window_print(statsp, end_tick, 0);
+    histogram_reset(&statsp->window);
+    statsp->window_start_tick = end_tick;
+  }
+}
+
+// Prints each window when it ends, even if the test is stuck waiting for a
+// sample, so that a stall shows up as empty windows at the time it happens.
+static void*
+window_thread_func(void *data)
+{
+  latency_stats_t *statsp = (latency_stats_t *)data;
+
+  pthread_mutex_lock(&statsp->lock);
+  while (!statsp->window_thread_stop) {
+    uint64_t now = tick(), nanoseconds = 0;
+    uint64_t end_tick = statsp->window_start_tick + statsp->window_ticks;
+    struct timespec deadline;
+
+    if (end_tick > now)
+      nanoseconds = tick_delta_to_nanoseconds(end_tick - now);
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    nanoseconds += deadline.tv_nsec;
+    deadline.tv_sec += nanoseconds / 1000000000;
+    deadline.tv_nsec = nanoseconds % 1000000000;
+    (void) pthread_cond_timedwait(&statsp->window_cond, &statsp->lock,
+                                  &deadline);
+
+    if (!statsp->window_thread_stop)
+      window_advance(statsp, tick());
+  }
+  pthread_mutex_unlock(&statsp->lock);
+
+  return NULL;
+}
+
+void
+stats_init(latency_stats_t *statsp,
+    uint64_t window_nanoseconds, uint64_t threshold_nanoseconds)
+{
+  histogram_reset(&statsp->all);
+  histogram_reset(&statsp->window);
+  statsp->threshold_nanoseconds = threshold_nanoseconds;
+  statsp->window_ticks = nanoseconds_to_tick_delta(window_nanoseconds);
+  statsp->start_tick = tick();
+  statsp->window_start_tick = statsp->start_tick;
+  statsp->window_thread_stop = 0;
+
+  if (statsp->window_ticks) {
+    pthread_mutex_init(&statsp->lock, NULL);
+    pthread_cond_init(&statsp->window_cond, NULL);
+    if (pthread_create(&statsp->window_thread, NULL, window_thread_func,
+                       statsp) != 0) {
+      LOG_ERR("pthread_create() failed, windows will only be printed when "
+              "samples arrive\n");
+      statsp->window_thread_stop = 1;
+    }
+  }
+}
+
+// Returns the tick |seconds| after stats_init(), or 0 (no deadline) if
+// |seconds| is 0. Basing -d on the same start as the windows makes the run
+// end on a window boundary.
+uint64_t
+stats_deadline_tick(latency_stats_t *statsp, int seconds)
+{
+  if (seconds == 0) {
+    return 0;
+  }
+
+  return statsp->start_tick +
+         nanoseconds_to_tick_delta((uint64_t)seconds * 1000000000);
+}
+
+void
+stats_record(latency_stats_t *statsp, uint64_t nanoseconds)
+{
+  histogram_record(&statsp->all, nanoseconds, statsp->threshold_nanoseconds);
+
+  if (statsp->window_ticks) {
+    pthread_mutex_lock(&statsp->lock);
+    window_advance(statsp, tick());
+    histogram_record(&statsp->window, nanoseconds,
+        statsp->threshold_nanoseconds);
+    pthread_mutex_unlock(&statsp->lock);
+  }
+}
+
+uint64_t
+stats_percentile(histogram_t *histp, double percentile)
+{
+  uint64_t target, seen = 0;
+
+  if (histp->count == 0) {
+    return 0;
+  }
+
+  target = (uint64_t)(percentile / 100.0 * histp->count + 0.5);
+  if (target == 0)
+    target = 1;
+
+  for (int i = 0; i < STATS_NUM_BUCKETS; i++) {
+    seen += histp->buckets[i];
+    if (seen >= target) {
+      uint64_t value = bucket_upper_bound(i);
+
+      if (value > histp->max)
+        value = histp->max;
+      if (value < histp->min)
+        value = histp->min;
+      return value;
+    }
+  }
+
+  return histp->max;
+}
+
+void
+stats_print(latency_stats_t *statsp)
+{
+  histogram_t *histp = &statsp->all;
+  uint64_t count = histp->count;
+
+  if (statsp->window_ticks) {
+    int running;
+    uint64_t now = tick();
+
+    pthread_mutex_lock(&statsp->lock);
+    running = !statsp->window_thread_stop;
+    statsp->window_thread_stop = 1;
+    pthread_cond_signal(&statsp->window_cond);
+    window_advance(statsp, now);
+    if (statsp->window.count)
+      window_print(statsp, now, 1);
+    pthread_mutex_unlock(&statsp->lock);
+
+    if (running)
+      (void) pthread_join(statsp->window_thread, NULL);
+  }
+
+  if (count == 0) {
+    PRINT("no samples recorded\n");
+    return;
+  }
+
+  PRINT("average over %" PRIu64 " iterations: %" PRIu64 " nanoseconds\n",
+      count, histp->total / count);
+  PRINT("    max over %" PRIu64 " iterations: %" PRIu64 " nanoseconds\n",
+      count, histp->max);
+  PRINT("    min over %" PRIu64 " iterations: %" PRIu64 " nanoseconds\n",
+      count, histp->min);
+  PRINT("    p50 over %" PRIu64 " iterations: %" PRIu64 " nanoseconds\n",
+      count, stats_percentile(histp, 50.0));
+  PRINT("    p99 over %" PRIu64 " iterations: %" PRIu64 " nanoseconds\n",
+      count, stats_percentile(histp, 99.0));
+  PRINT("  p99.9 over %" PRIu64 " iterations: %" PRIu64 " nanoseconds\n",
+      count, stats_percentile(histp, 99.9));
+  if (statsp->threshold_nanoseconds) {
+    PRINT("   over %" PRIu64 " nanoseconds: %" PRIu64 " of %" PRIu64
+        " iterations\n",
+        statsp->threshold_nanoseconds, histp->over_threshold, count);
+  }
+}
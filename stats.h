@@ -0,0 +1,54 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+/*
+ * Latency samples are kept in a log-linear histogram so that memory use is
+ * fixed regardless of the number of iterations. Values below
+ * STATS_SUB_BUCKETS nanoseconds are recorded exactly; above that, each power
+ * of two is split into STATS_SUB_BUCKETS buckets, which bounds the error of a
+ * reported percentile to 1/STATS_SUB_BUCKETS of the value.
+ */
+#define STATS_SUB_BUCKET_BITS   5
+#define STATS_SUB_BUCKETS       (1 << STATS_SUB_BUCKET_BITS)
+#define STATS_NUM_BUCKETS       ((64 - STATS_SUB_BUCKET_BITS + 1) * \
+                                 STATS_SUB_BUCKETS)
+
+typedef struct {
+  uint64_t              count;
+  uint64_t              total;
+  uint64_t              min;
+  uint64_t              max;
+  uint64_t              over_threshold;
+  uint64_t              buckets[STATS_NUM_BUCKETS];
+} histogram_t;
+
+/*
+ * Totals for the whole run plus, when a window interval is set, a second
+ * histogram that is printed and reset every interval so that periodic
+ * spikes in long runs show up as a time series. The windows are printed by a
+ * thread on fixed boundaries, so stats_print() must be called to stop it.
+ */
+typedef struct {
+  histogram_t           all;
+  histogram_t           window;
+  uint64_t              threshold_nanoseconds;
+  uint64_t              window_ticks;
+  uint64_t              start_tick;
+  uint64_t              window_start_tick;
+  pthread_mutex_t       lock;
+  pthread_cond_t        window_cond;
+  pthread_t             window_thread;
+  int                   window_thread_stop;
+} latency_stats_t;
+
+void stats_init(latency_stats_t *statsp,
+    uint64_t window_nanoseconds, uint64_t threshold_nanoseconds);
+uint64_t stats_deadline_tick(latency_stats_t *statsp, int seconds);
+void stats_record(latency_stats_t *statsp, uint64_t nanoseconds);
+uint64_t stats_percentile(histogram_t *histp, double percentile);
+void stats_print(latency_stats_t *statsp);
+
+#endif
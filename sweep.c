@@ -0,0 +1,249 @@
+#if defined(LINUX)
+#define _GNU_SOURCE
+#endif
+
+#include <inttypes.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sweep.h"
+#include "timer.h"
+#include "utils.h"
+
+#define SYSFS_CPU_PATH          "/sys/devices/system/cpu"
+
+// Reads a single unsigned integer from a sysfs file. Returns 0 on success.
+static int
+read_sysfs_u64(const char *path, uint64_t *valuep)
+{
+  FILE *fp;
+  int rv;
+
+  fp = fopen(path, "r");
+  if (fp == NULL) {
+    return -1;
+  }
+  rv = fscanf(fp, "%" SCNu64, valuep) == 1 ? 0 : -1;
+  fclose(fp);
+
+  return rv;
+}
+
+// Reads the counters of |child_cpu|, or sums them over every CPU if it is -1.
+static void
+read_cpu_state(int child_cpu, cpu_state_t *statep)
+{
+  long first_cpu = child_cpu, last_cpu = child_cpu;
+  char path[256];
+
+  if (child_cpu < 0) {
+    first_cpu = 0;
+    last_cpu = sysconf(_SC_NPROCESSORS_CONF) - 1;
+  }
+
+  memset(statep, 0, sizeof (*statep));
+
+  for (long cpu = first_cpu; cpu <= last_cpu; cpu++) {
+    uint64_t value;
+
+    snprintf(path, sizeof (path),
+             SYSFS_CPU_PATH "/cpu%ld/cpufreq/scaling_cur_freq", cpu);
+    if (read_sysfs_u64(path, &value) == 0) {
+      statep->total_frequency_khz += value;
+      statep->frequency_cpus++;
+    }
+
+    for (int state = 0; state < MAX_IDLE_STATES; state++) {
+      FILE *fp;
+
+      snprintf(path, sizeof (path),
+               SYSFS_CPU_PATH "/cpu%ld/cpuidle/state%d/name", cpu, state);
+      fp = fopen(path, "r");
+      if (fp == NULL) {
+        break;
+      }
+      if (fscanf(fp, "%15s", statep->idle_state_names[state]) != 1) {
+        statep->idle_state_names[state][0] = '\0';
+      }
+      fclose(fp);
+
+      snprintf(path, sizeof (path),
+               SYSFS_CPU_PATH "/cpu%ld/cpuidle/state%d/usage", cpu, state);
+      if (read_sysfs_u64(path, &value) == 0)
+        statep->idle_state_usage[state] += value;
+
+      snprintf(path, sizeof (path),
+               SYSFS_CPU_PATH "/cpu%ld/cpuidle/state%d/time", cpu, state);
+      if (read_sysfs_u64(path, &value) == 0)
+        statep->idle_state_microseconds[state] += value;
+
+      if (state >= statep->num_idle_states)
+        statep->num_idle_states = state + 1;
+    }
+  }
+}
+
+static void
+print_cpu_state_delta(cpu_state_t *beforep, cpu_state_t *afterp)
+{
+  if (afterp->frequency_cpus) {
+    PRINT("    %s frequency %" PRIu64 " MHz\n",
+        afterp->frequency_cpus > 1 ? "average" : "child CPU",
+        afterp->total_frequency_khz / afterp->frequency_cpus / 1000);
+  } else {
+    PRINT("    frequency not available\n");
+  }
+
+  if (afterp->num_idle_states == 0) {
+    PRINT("    idle states not available\n");
+    return;
+  }
+
+  PRINT("    idle state entries (residency):");
+  for (int state = 0; state < afterp->num_idle_states; state++) {
+    PRINT(" %s %" PRIu64 " (%" PRIu64 " us)",
+        afterp->idle_state_names[state],
+        afterp->idle_state_usage[state] - beforep->idle_state_usage[state],
+        afterp->idle_state_microseconds[state] -
+        beforep->idle_state_microseconds[state]);
+  }
+  PRINT("\n");
+}
+
+// Picks the CPU that the child's waiting thread is pinned to for -C, so that
+// the idle counters of that one CPU can be read: the highest-numbered CPU the
+// calling (parent) thread may run on. The parent is moved off it when there
+// is another CPU to run on. Returns -1 where CPU affinity is not supported.
+static int
+choose_child_cpu(void)
+{
+#if defined(LINUX)
+  cpu_set_t set;
+  int cpu = -1;
+
+  if (sched_getaffinity(0, sizeof (set), &set) == -1) {
+    return -1;
+  }
+  for (int c = 0; c < CPU_SETSIZE; c++) {
+    if (CPU_ISSET(c, &set))
+      cpu = c;
+  }
+
+  if (CPU_COUNT(&set) > 1) {
+    CPU_CLR(cpu, &set);
+    if (sched_setaffinity(0, sizeof (set), &set) == -1)
+      LOG_ERR("sched_setaffinity() failed for the parent\n");
+  }
+
+  return cpu;
+#else
+  return -1;
+#endif
+}
+
+// Pins the calling thread to the CPU chosen by idle_sweep_init(). The child
+// calls this from the thread whose wakeup is timed.
+void
+idle_sweep_pin_child(int cpu)
+{
+#if defined(LINUX)
+  cpu_set_t set;
+
+  if (cpu < 0) {
+    return;
+  }
+
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  if (sched_setaffinity(0, sizeof (set), &set) == -1)
+    LOG_ERR("sched_setaffinity() failed for the child\n");
+#endif
+}
+
+void
+idle_sweep_init(idle_sweep_t *sweepp, int max_microseconds,
+    int iterations_per_bucket, int record_cpu_state)
+{
+  uint64_t microseconds = 1;
+
+  memset(sweepp, 0, sizeof (*sweepp));
+  sweepp->iterations_per_bucket = iterations_per_bucket;
+  sweepp->record_cpu_state = record_cpu_state;
+
+  sweepp->idle_microseconds[sweepp->num_buckets++] = 0;
+  for (int n = 0; microseconds <= max_microseconds &&
+       sweepp->num_buckets < MAX_SWEEP_BUCKETS; n++) {
+    sweepp->idle_microseconds[sweepp->num_buckets++] = microseconds;
+
+    // 1, 2, 5, 10, 20, 50, ...
+    if (n % 3 == 1)
+      microseconds = microseconds * 5 / 2;
+    else
+      microseconds *= 2;
+  }
+
+  stats_init(&sweepp->stats, 0, 0);
+  sweepp->cpu = -1;
+  if (record_cpu_state) {
+    sweepp->cpu = choose_child_cpu();
+    read_cpu_state(sweepp->cpu, &sweepp->cpu_state);
+  }
+}
+
+// Returns the total number of iterations needed to fill every bucket.
+int
+idle_sweep_iterations(idle_sweep_t *sweepp)
+{
+  return sweepp->num_buckets * sweepp->iterations_per_bucket;
+}
+
+// Stays away from the child for exactly the current bucket's idle time.
+// wait_until_tick() spins at the end, so the parent itself is not paying a
+// deep idle exit before it sends the poke.
+void
+idle_sweep_pause(idle_sweep_t *sweepp)
+{
+  uint64_t microseconds;
+
+  if (sweepp->bucket >= sweepp->num_buckets) {
+    return;
+  }
+
+  microseconds = sweepp->idle_microseconds[sweepp->bucket];
+  if (microseconds)
+    wait_until_tick(tick() + nanoseconds_to_tick_delta(microseconds * 1000));
+}
+
+void
+idle_sweep_record(idle_sweep_t *sweepp, uint64_t nanoseconds)
+{
+  histogram_t *histp = &sweepp->stats.all;
+  cpu_state_t cpu_state;
+
+  if (sweepp->bucket >= sweepp->num_buckets) {
+    return;
+  }
+
+  stats_record(&sweepp->stats, nanoseconds);
+  if (histp->count < sweepp->iterations_per_bucket) {
+    return;
+  }
+
+  PRINT("idle %7" PRIu64 " us: average %" PRIu64 ", p50 %" PRIu64
+      ", p99 %" PRIu64 ", max %" PRIu64 " nanoseconds\n",
+      sweepp->idle_microseconds[sweepp->bucket],
+      histp->total / histp->count, stats_percentile(histp, 50.0),
+      stats_percentile(histp, 99.0), histp->max);
+
+  if (sweepp->record_cpu_state) {
+    read_cpu_state(sweepp->cpu, &cpu_state);
+    print_cpu_state_delta(&sweepp->cpu_state, &cpu_state);
+    sweepp->cpu_state = cpu_state;
+  }
+
+  sweepp->bucket++;
+  stats_init(&sweepp->stats, 0, 0);
+}
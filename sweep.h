@@ -0,0 +1,51 @@
+#ifndef SWEEP_H
+#define SWEEP_H
+
+#include <stdint.h>
+
+#include "stats.h"
+
+#define MAX_SWEEP_BUCKETS       32
+#define MAX_IDLE_STATES         16
+
+/*
+ * Idle-state counters of the child's CPU (or summed over all CPUs where the
+ * child cannot be pinned), read from /sys/devices/system/cpu/cpu<N>/cpuidle
+ * and cpufreq. num_idle_states is 0 where the kernel does not expose them.
+ */
+typedef struct {
+  int                   num_idle_states;
+  char                  idle_state_names[MAX_IDLE_STATES][16];
+  uint64_t              idle_state_usage[MAX_IDLE_STATES];
+  uint64_t              idle_state_microseconds[MAX_IDLE_STATES];
+  uint64_t              total_frequency_khz;
+  int                   frequency_cpus;
+} cpu_state_t;
+
+/*
+ * Deterministic sweep over the time the child is left idle before each poke.
+ * Buckets run from 0 to the maximum in a 1-2-5 series and each gets
+ * |iterations_per_bucket| samples, after which its latency distribution
+ * (and optionally the CPU frequency and idle-state changes) is printed.
+ * With |record_cpu_state| the parent is moved off |cpu| and the child pins
+ * its waiting thread to it with idle_sweep_pin_child().
+ */
+typedef struct {
+  int                   num_buckets;
+  uint64_t              idle_microseconds[MAX_SWEEP_BUCKETS];
+  int                   iterations_per_bucket;
+  int                   bucket;
+  latency_stats_t       stats;
+  int                   record_cpu_state;
+  int                   cpu;
+  cpu_state_t           cpu_state;
+} idle_sweep_t;
+
+void idle_sweep_init(idle_sweep_t *sweepp, int max_microseconds,
+    int iterations_per_bucket, int record_cpu_state);
+int idle_sweep_iterations(idle_sweep_t *sweepp);
+void idle_sweep_pin_child(int cpu);
+void idle_sweep_pause(idle_sweep_t *sweepp);
+void idle_sweep_record(idle_sweep_t *sweepp, uint64_t nanoseconds);
+
+#endif
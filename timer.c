@@ -1,4 +1,5 @@
 #include <stdint.h>
+#include <unistd.h>
 
 #if defined(MACOS)
 #include <mach/mach.h>
@@ -10,6 +11,12 @@
 #include <time.h>
 #endif
 
+#include "timer.h"
+
+// wait_until_tick() sleeps until it is this close to the target and then
+// spins, since usleep() routinely overshoots by tens of microseconds.
+#define WAIT_SPIN_NANOSECONDS   20000
+
 #if defined(MACOS)
 static mach_timebase_info_data_t mach_time_info;
 
@@ -31,6 +38,12 @@ tick_delta_to_nanoseconds(uint64_t delta)
   return delta * mach_time_info.numer / mach_time_info.denom;
 }
 
+uint64_t
+nanoseconds_to_tick_delta(uint64_t nanoseconds)
+{
+  return nanoseconds * mach_time_info.denom / mach_time_info.numer;
+}
+
 #elif defined(LINUX)
 
 void
@@ -58,4 +71,29 @@ tick_delta_to_nanoseconds(uint64_t delta)
   return delta;
 }
 
+uint64_t
+nanoseconds_to_tick_delta(uint64_t nanoseconds)
+{
+  return nanoseconds;
+}
+
 #endif
+
+void
+wait_until_tick(uint64_t target_tick)
+{
+  uint64_t now;
+
+  while ((now = tick()) < target_tick) {
+    uint64_t remaining = tick_delta_to_nanoseconds(target_tick - now);
+
+    if (remaining > WAIT_SPIN_NANOSECONDS)
+      usleep((remaining - WAIT_SPIN_NANOSECONDS) / 1000);
+  }
+}
+
+int
+deadline_passed(uint64_t deadline_tick)
+{
+  return deadline_tick != 0 && tick() >= deadline_tick;
+}
@@ -3,3 +3,6 @@
 void timer_init(void);
 uint64_t tick(void);
 uint64_t tick_delta_to_nanoseconds(uint64_t delta);
+uint64_t nanoseconds_to_tick_delta(uint64_t nanoseconds);
+void wait_until_tick(uint64_t target_tick);
+int deadline_passed(uint64_t deadline_tick);
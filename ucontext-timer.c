@@ -0,0 +1,238 @@
+#if defined(MACOS)
+#define _XOPEN_SOURCE           600
+#endif
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#include "stats.h"
+#include "timer.h"
+#include "utils.h"
+
+#define NUM_TEST_ITERATIONS     1000
+#define COROUTINE_STACK_SIZE    (64 * 1024)
+
+/*
+ * Baseline for the other tests: the cost of handing control from one thread
+ * of execution to another entirely in user space. A "parent" and a "child"
+ * coroutine run on the same kernel thread. The parent records a timestamp
+ * and switches to the child, and the child records a timestamp as soon as it
+ * is resumed, mirroring the poke and reply ticks of pipe-timer. The delta is
+ * the handoff latency a user-space scheduler would pay in place of a kernel
+ * wakeup.
+ *
+ * Two switch implementations are measured:
+ *
+ *   swapcontext  - the libc ucontext API. It saves and restores the signal
+ *                  mask, which costs a sigprocmask system call per switch.
+ *   assembly     - a minimal switch that only saves the callee-saved
+ *                  registers and the stack pointer (x86_64 and arm64 only).
+ */
+
+int logging_enabled = 0;
+test_args_t test_args = { .iterations = NUM_TEST_ITERATIONS };
+
+volatile uint64_t child_wake_tick;
+
+static ucontext_t main_uctx, child_uctx;
+
+void
+child_ucontext_func(void)
+{
+  while (1) {
+    child_wake_tick = tick();
+    (void) swapcontext(&child_uctx, &main_uctx);
+  }
+}
+
+#if defined(__APPLE__)
+#define ASM_SYMBOL(name)        "_" #name
+#else
+#define ASM_SYMBOL(name)        #name
+#endif
+
+#if defined(__x86_64__) || defined(__aarch64__)
+#define HAVE_ASM_SWITCH         1
+
+// Saves the callee-saved registers on the current stack, stores the stack
+// pointer in *save_sp and resumes the context whose stack pointer is load_sp.
+void switch_context(void **save_sp, void *load_sp);
+
+#if defined(__x86_64__)
+__asm__(
+  ".text\n"
+  ".globl " ASM_SYMBOL(switch_context) "\n"
+  ".p2align 4\n"
+  ASM_SYMBOL(switch_context) ":\n"
+  "  pushq %rbp\n"
+  "  pushq %rbx\n"
+  "  pushq %r12\n"
+  "  pushq %r13\n"
+  "  pushq %r14\n"
+  "  pushq %r15\n"
+  "  movq %rsp, (%rdi)\n"
+  "  movq %rsi, %rsp\n"
+  "  popq %r15\n"
+  "  popq %r14\n"
+  "  popq %r13\n"
+  "  popq %r12\n"
+  "  popq %rbx\n"
+  "  popq %rbp\n"
+  "  ret\n"
+);
+
+// callee-saved registers pushed by switch_context(), plus the return address
+#define SWITCH_FRAME_WORDS      7
+#define SWITCH_FRAME_ENTRY      6
+#else
+__asm__(
+  ".text\n"
+  ".globl " ASM_SYMBOL(switch_context) "\n"
+  ".p2align 4\n"
+  ASM_SYMBOL(switch_context) ":\n"
+  "  sub sp, sp, #160\n"
+  "  stp x19, x20, [sp, #0]\n"
+  "  stp x21, x22, [sp, #16]\n"
+  "  stp x23, x24, [sp, #32]\n"
+  "  stp x25, x26, [sp, #48]\n"
+  "  stp x27, x28, [sp, #64]\n"
+  "  stp x29, x30, [sp, #80]\n"
+  "  stp d8, d9, [sp, #96]\n"
+  "  stp d10, d11, [sp, #112]\n"
+  "  stp d12, d13, [sp, #128]\n"
+  "  stp d14, d15, [sp, #144]\n"
+  "  mov x9, sp\n"
+  "  str x9, [x0]\n"
+  "  mov sp, x1\n"
+  "  ldp x19, x20, [sp, #0]\n"
+  "  ldp x21, x22, [sp, #16]\n"
+  "  ldp x23, x24, [sp, #32]\n"
+  "  ldp x25, x26, [sp, #48]\n"
+  "  ldp x27, x28, [sp, #64]\n"
+  "  ldp x29, x30, [sp, #80]\n"
+  "  ldp d8, d9, [sp, #96]\n"
+  "  ldp d10, d11, [sp, #112]\n"
+  "  ldp d12, d13, [sp, #128]\n"
+  "  ldp d14, d15, [sp, #144]\n"
+  "  add sp, sp, #160\n"
+  "  ret\n"
+);
+
+// 20 saved registers; x30 (the return address) is word 11
+#define SWITCH_FRAME_WORDS      20
+#define SWITCH_FRAME_ENTRY      11
+#endif
+
+static void *main_sp, *child_sp;
+
+void
+child_asm_func(void)
+{
+  while (1) {
+    child_wake_tick = tick();
+    switch_context(&child_sp, main_sp);
+  }
+}
+
+// Lays out a stack so that the first switch_context() to it "returns" into
+// entry with the stack aligned as the ABI expects at a function call.
+void*
+init_asm_stack(char *stack, size_t size, void (*entry)(void))
+{
+  uintptr_t top = ((uintptr_t)stack + size) & ~(uintptr_t)15;
+  void **frame;
+
+#if defined(__x86_64__)
+  // functions are entered with the stack 8 bytes off 16-byte alignment, as
+  // if their return address had just been pushed; entry never returns
+  top -= 8;
+#endif
+
+  frame = (void **)top - SWITCH_FRAME_WORDS;
+  memset(frame, 0, SWITCH_FRAME_WORDS * sizeof (void *));
+  frame[SWITCH_FRAME_ENTRY] = (void *)entry;
+
+  return frame;
+}
+#endif
+
+void
+record_handoff(latency_stats_t *statsp, uint64_t start_tick)
+{
+  uint64_t delta = tick_delta_to_nanoseconds(child_wake_tick - start_tick);
+
+  LOG("%" PRIu64 " nanoseconds\n", delta);
+  stats_record(statsp, delta);
+}
+
+int
+main(int argc, char** argv)
+{
+  int                   rv, iterations;
+  char                  *stack;
+  latency_stats_t       stats;
+
+  timer_init();
+
+  rv = get_args(argc, argv, ARGS_SLEEP, &test_args);
+  if (rv != 0) {
+    exit(rv);
+  }
+  logging_enabled = test_args.logging;
+  iterations = test_args.iterations;
+
+  stack = malloc(COROUTINE_STACK_SIZE);
+  if (stack == NULL) {
+    LOG_ERR("malloc() failed\n");
+    exit(-1);
+  }
+
+  if (getcontext(&child_uctx) == -1) {
+    LOG_ERR("getcontext() failed\n");
+    exit(-1);
+  }
+  child_uctx.uc_stack.ss_sp = stack;
+  child_uctx.uc_stack.ss_size = COROUTINE_STACK_SIZE;
+  child_uctx.uc_link = NULL;
+  makecontext(&child_uctx, child_ucontext_func, 0);
+
+  stats_init(&stats, 0, 0);
+  for (int i = 0; i < iterations; i++) {
+    uint64_t start;
+
+    if (test_args.sleep_microseconds)
+      random_usleep(test_args.sleep_microseconds);
+
+    start = tick();
+    (void) swapcontext(&main_uctx, &child_uctx);
+    record_handoff(&stats, start);
+  }
+  PRINT("swapcontext:\n");
+  stats_print(&stats);
+
+#if defined(HAVE_ASM_SWITCH)
+  child_sp = init_asm_stack(stack, COROUTINE_STACK_SIZE, child_asm_func);
+
+  stats_init(&stats, 0, 0);
+  for (int i = 0; i < iterations; i++) {
+    uint64_t start;
+
+    if (test_args.sleep_microseconds)
+      random_usleep(test_args.sleep_microseconds);
+
+    start = tick();
+    switch_context(&main_sp, child_sp);
+    record_handoff(&stats, start);
+  }
+  PRINT("assembly switch:\n");
+  stats_print(&stats);
+#endif
+
+  free(stack);
+
+  exit(0);
+}
@@ -1,55 +1,342 @@
+#include <limits.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
 #include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/uio.h>
 #include <unistd.h>
 #include <string.h>
 
+#include "sweep.h"
 #include "utils.h"
 
 void
-usage(int argc, char **argv)
+usage(char **argv, int flags)
 {
-  PRINT("usage: %s [-l] [-i <iterations>]\n\n", argv[0]);
+  PRINT("usage: %s [-l]", argv[0]);
+  if (flags & ARGS_THREADS)
+    PRINT(" [-T]");
+  PRINT(" [-i <iterations>]");
+  if (flags & ARGS_SLEEP)
+    PRINT(" [-s <microseconds>]");
+  if (flags & ARGS_SWEEP)
+    PRINT(" [-S <microseconds> [-C]]");
+  if (flags & ARGS_SOAK)
+    PRINT(" [-d <seconds>] [-w <seconds>] [-t <nanoseconds>]");
+  if (flags & ARGS_OPEN_LOOP)
+    PRINT(" [-r <rate> [-p]]");
+  if (flags & ARGS_TRANSPORT)
+    PRINT(" [-x <transport> [-b <microseconds>]]");
+  if (flags & ARGS_SPIN)
+    PRINT(" [-n <spins> | -N <spins>] [-y]");
+  if (flags & ARGS_CHAIN)
+    PRINT(" [-H <stages>]");
+  if (flags & ARGS_CHANNELS)
+    PRINT(" [-c <channels>] [-k <pipe|eventfd>]");
+  if (flags & ARGS_SPAWN)
+    PRINT(" [-m <megabytes>]");
+  if (flags & ARGS_TRANSFER)
+    PRINT(" [-z <bytes>]");
+  PRINT("\n\n");
   PRINT("  -l                 enables logging\n");
+  if (flags & ARGS_THREADS)
+    PRINT("  -T                 run parent and child as threads, not "
+          "processes\n");
   PRINT("  -i <ITERATIONS>    specify the number of test iterations\n");
-  PRINT("  -s <MICROSECONDS>  enables random sleeps up to MICROSECONDS\n");
+  if (flags & ARGS_SLEEP)
+    PRINT("  -s <MICROSECONDS>  enables random sleeps up to MICROSECONDS\n");
+  if (flags & ARGS_SWEEP) {
+    PRINT("  -S <MICROSECONDS>  sweep idle times from 0 to MICROSECONDS\n");
+    PRINT("  -C                 report CPU frequency and idle states with "
+          "-S\n");
+  }
+  if (flags & ARGS_SOAK) {
+    PRINT("  -d <SECONDS>       run for SECONDS, or until -i iterations\n");
+    PRINT("  -w <SECONDS>       print rolling statistics every SECONDS\n");
+    PRINT("  -t <NANOSECONDS>   count samples slower than NANOSECONDS\n");
+  }
+  if (flags & ARGS_OPEN_LOOP) {
+    PRINT("  -r <RATE>          open-loop mode: send RATE pokes per second\n");
+    PRINT("  -p                 use Poisson inter-arrival times with -r\n");
+  }
+  if (flags & ARGS_TRANSPORT) {
+    PRINT("  -x <TRANSPORT>     pipe (default), unix, tcp or udp (loopback)\n");
+    PRINT("  -b <MICROSECONDS>  set SO_BUSY_POLL on tcp and udp transports\n");
+  }
+  if (flags & ARGS_SPIN) {
+    PRINT("  -n <SPINS>         spin up to SPINS times before blocking\n");
+    PRINT("  -N <SPINS>         sweep spin counts from 0 to SPINS\n");
+    PRINT("  -y                 yield instead of pausing while spinning\n");
+  }
+  if (flags & ARGS_CHAIN) {
+    PRINT("  -H <STAGES>        number of stages, or a list such as "
+          "p:pipe,t:tcp giving\n");
+    PRINT("                     each stage as a process (p) or thread (t) "
+          "and the\n");
+    PRINT("                     transport into it\n");
+  }
+  if (flags & ARGS_CHANNELS) {
+    PRINT("  -c <CHANNELS>      number of channels (default: sweep)\n");
+    PRINT("  -k <KIND>          channel kind: pipe (default) or eventfd\n");
+  }
+  if (flags & ARGS_SPAWN)
+    PRINT("  -m <MEGABYTES>     parent resident memory (default: sweep)\n");
+  if (flags & ARGS_TRANSFER)
+    PRINT("  -z <BYTES>         transfer size (default: sweep)\n");
+}
+
+// Returns the TRANSPORT_* value named by |name|, or -1 if there is none.
+int
+parse_transport(const char *name)
+{
+  if (strcmp(name, "pipe") == 0)
+    return TRANSPORT_PIPE;
+  if (strcmp(name, "unix") == 0)
+    return TRANSPORT_UNIX;
+  if (strcmp(name, "tcp") == 0)
+    return TRANSPORT_TCP;
+  if (strcmp(name, "udp") == 0)
+    return TRANSPORT_UDP;
+
+  return -1;
 }
 
 int
-get_args(int argc, char **argv, int *sleepp, int *loggingp, int *iterationsp)
+get_args(int argc, char **argv, int flags, test_args_t *argsp)
 {
-  char option;
+  int option, iterations_set = 0;
+  char optstring[64] = "li:";
 
-  while ((option = getopt(argc, argv, "s:li:")) != -1) {
+  if (flags & ARGS_SLEEP)
+    strcat(optstring, "s:");
+  if (flags & ARGS_SWEEP)
+    strcat(optstring, "S:C");
+  if (flags & ARGS_THREADS)
+    strcat(optstring, "T");
+  if (flags & ARGS_SOAK)
+    strcat(optstring, "d:w:t:");
+  if (flags & ARGS_OPEN_LOOP)
+    strcat(optstring, "r:p");
+  if (flags & ARGS_TRANSPORT)
+    strcat(optstring, "x:b:");
+  if (flags & ARGS_SPIN)
+    strcat(optstring, "n:N:y");
+  if (flags & ARGS_CHAIN)
+    strcat(optstring, "H:");
+  if (flags & ARGS_CHANNELS)
+    strcat(optstring, "c:k:");
+  if (flags & ARGS_SPAWN)
+    strcat(optstring, "m:");
+  if (flags & ARGS_TRANSFER)
+    strcat(optstring, "z:");
+
+  while ((option = getopt(argc, argv, optstring)) != -1) {
     switch (option)
     {
     case 's':
-      *sleepp = atoi(optarg);
-      if (*sleepp <= 0) {
-        LOG_ERR("Option -%c should be a positive integer.\n", optopt);
+      argsp->sleep_microseconds = atoi(optarg);
+      if (argsp->sleep_microseconds <= 0) {
+        LOG_ERR("Option -%c should be a positive integer.\n", option);
+        return -1;
+      }
+      break;
+    case 'S':
+      argsp->sweep_microseconds = atoi(optarg);
+      if (argsp->sweep_microseconds <= 0) {
+        LOG_ERR("Option -%c should be a positive integer.\n", option);
         return -1;
       }
       break;
+    case 'C':
+      argsp->record_cpu_state = 1;
+      break;
     case 'l':
-      *loggingp = 1;
+      argsp->logging = 1;
+      break;
+    case 'T':
+      argsp->threads = 1;
       break;
     case 'i':
-      *iterationsp = atoi(optarg);
-      if (*iterationsp <= 0) {
-        LOG_ERR("Option -%c should be a positive integer.\n", optopt);
+      argsp->iterations = atoi(optarg);
+      if (argsp->iterations <= 0) {
+        LOG_ERR("Option -%c should be a positive integer.\n", option);
+        return -1;
+      }
+      iterations_set = 1;
+      break;
+    case 'd':
+      argsp->duration_seconds = atoi(optarg);
+      if (argsp->duration_seconds <= 0) {
+        LOG_ERR("Option -%c should be a positive integer.\n", option);
+        return -1;
+      }
+      break;
+    case 'w':
+      argsp->window_seconds = atoi(optarg);
+      if (argsp->window_seconds <= 0) {
+        LOG_ERR("Option -%c should be a positive integer.\n", option);
+        return -1;
+      }
+      break;
+    case 't':
+      argsp->threshold_nanoseconds = atoi(optarg);
+      if (argsp->threshold_nanoseconds <= 0) {
+        LOG_ERR("Option -%c should be a positive integer.\n", option);
+        return -1;
+      }
+      break;
+    case 'r':
+      argsp->rate = atoi(optarg);
+      if (argsp->rate <= 0) {
+        LOG_ERR("Option -%c should be a positive integer.\n", option);
+        return -1;
+      }
+      break;
+    case 'p':
+      argsp->poisson = 1;
+      break;
+    case 'x':
+      argsp->transport = parse_transport(optarg);
+      if (argsp->transport == -1) {
+        LOG_ERR("Unknown transport %s.\n", optarg);
+        return -1;
+      }
+      break;
+    case 'b':
+      argsp->busy_poll_microseconds = atoi(optarg);
+      if (argsp->busy_poll_microseconds <= 0) {
+        LOG_ERR("Option -%c should be a positive integer.\n", option);
+        return -1;
+      }
+      break;
+    case 'n':
+      argsp->spin_iterations = atoi(optarg);
+      if (argsp->spin_iterations <= 0) {
+        LOG_ERR("Option -%c should be a positive integer.\n", option);
+        return -1;
+      }
+      break;
+    case 'N':
+      argsp->spin_sweep_max = atoi(optarg);
+      if (argsp->spin_sweep_max <= 0) {
+        LOG_ERR("Option -%c should be a positive integer.\n", option);
+        return -1;
+      }
+      break;
+    case 'y':
+      argsp->spin_yield = 1;
+      break;
+    case 'H':
+      argsp->stages = optarg;
+      break;
+    case 'c':
+      argsp->channels = atoi(optarg);
+      if (argsp->channels <= 0) {
+        LOG_ERR("Option -%c should be a positive integer.\n", option);
+        return -1;
+      }
+      break;
+    case 'k':
+      if (strcmp(optarg, "pipe") == 0) {
+        argsp->channel_kind = CHANNEL_PIPE;
+      } else if (strcmp(optarg, "eventfd") == 0) {
+        argsp->channel_kind = CHANNEL_EVENTFD;
+      } else {
+        LOG_ERR("Unknown channel kind %s.\n", optarg);
+        return -1;
+      }
+      break;
+    case 'm':
+      argsp->megabytes = atoi(optarg);
+      if (argsp->megabytes < 0) {
+        LOG_ERR("Option -%c should not be negative.\n", option);
+        return -1;
+      }
+      break;
+    case 'z':
+      argsp->transfer_bytes = atoi(optarg);
+      if (argsp->transfer_bytes <= 0) {
+        LOG_ERR("Option -%c should be a positive integer.\n", option);
         return -1;
       }
       break;
     default:
-      usage(argc, argv);
+      usage(argv, flags);
       return -1;
     }
   }
 
+  if (argsp->duration_seconds && !iterations_set) {
+    argsp->iterations = INT_MAX;
+  }
+
+  if (argsp->poisson && !argsp->rate) {
+    LOG_ERR("Option -p requires -r.\n");
+    return -1;
+  }
+
+  // busy polling only applies to sockets that are fed by a network device
+  if (argsp->busy_poll_microseconds && argsp->transport != TRANSPORT_TCP &&
+      argsp->transport != TRANSPORT_UDP) {
+    LOG_ERR("Option -b requires the tcp or udp transport.\n");
+    return -1;
+  }
+
+  if (argsp->rate && argsp->sleep_microseconds) {
+    LOG_ERR("Options -r and -s are mutually exclusive.\n");
+    return -1;
+  }
+
+  if (argsp->record_cpu_state && !argsp->sweep_microseconds) {
+    LOG_ERR("Option -C requires -S.\n");
+    return -1;
+  }
+
+  if (argsp->sweep_microseconds &&
+      (argsp->sleep_microseconds || argsp->rate)) {
+    LOG_ERR("Option -S cannot be combined with -s or -r.\n");
+    return -1;
+  }
+
+  // -S sets its own iteration count, which -d would make unlimited
+  if (argsp->sweep_microseconds && argsp->duration_seconds) {
+    LOG_ERR("Option -S cannot be combined with -d.\n");
+    return -1;
+  }
+
+  // -S runs -i iterations for each of up to MAX_SWEEP_BUCKETS idle times
+  if (argsp->sweep_microseconds &&
+      argsp->iterations > INT_MAX / MAX_SWEEP_BUCKETS) {
+    LOG_ERR("Option -i should be at most %d with -S.\n",
+            INT_MAX / MAX_SWEEP_BUCKETS);
+    return -1;
+  }
+
+  if (argsp->spin_sweep_max &&
+      (argsp->spin_iterations || argsp->sweep_microseconds)) {
+    LOG_ERR("Option -N cannot be combined with -n or -S.\n");
+    return -1;
+  }
+
+  // -N sets its own iteration count, which -d would make unlimited
+  if (argsp->spin_sweep_max && argsp->duration_seconds) {
+    LOG_ERR("Option -N cannot be combined with -d.\n");
+    return -1;
+  }
+
+  if (argsp->spin_yield && !argsp->spin_iterations && !argsp->spin_sweep_max) {
+    LOG_ERR("Option -y requires -n or -N.\n");
+    return -1;
+  }
+
   return 0;
 }
 
@@ -59,6 +346,24 @@ random_usleep(uint64_t max_microseconds)
     usleep(random() % max_microseconds);
 }
 
+// Returns the time until the next open-loop poke should be sent. With -p the
+// gaps are exponentially distributed, giving Poisson arrivals at the same
+// mean rate.
+uint64_t
+next_arrival_nanoseconds(test_args_t *argsp)
+{
+  double mean_nanoseconds = 1000000000.0 / argsp->rate;
+  double u;
+
+  if (!argsp->poisson) {
+    return (uint64_t)mean_nanoseconds;
+  }
+
+  // uniform in (0, 1] so that log() is finite
+  u = (random() + 1.0) / 2147483648.0;
+  return (uint64_t)(-log(u) * mean_nanoseconds);
+}
+
 void*
 create_shared_memory(size_t shm_size)
 {
@@ -68,6 +373,122 @@ create_shared_memory(size_t shm_size)
   return shared_memory;
 }
 
+static int
+set_socket_options(int fd, int transport, int busy_poll_microseconds)
+{
+  int one = 1;
+
+  if (transport == TRANSPORT_TCP &&
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one)) == -1) {
+    LOG_ERR("setsockopt(TCP_NODELAY) failed: %s\n", strerror(errno));
+    return -1;
+  }
+
+  if (busy_poll_microseconds) {
+#if defined(SO_BUSY_POLL)
+    if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &busy_poll_microseconds,
+                   sizeof (busy_poll_microseconds)) == -1) {
+      LOG_ERR("setsockopt(SO_BUSY_POLL) failed: %s\n", strerror(errno));
+      return -1;
+    }
+#else
+    LOG_ERR("SO_BUSY_POLL is not supported on this platform\n");
+    return -1;
+#endif
+  }
+
+  return 0;
+}
+
+static int
+create_loopback_socket(int type, struct sockaddr_in *addrp)
+{
+  int fd;
+  socklen_t addr_len = sizeof (*addrp);
+
+  fd = socket(AF_INET, type, 0);
+  if (fd == -1) {
+    return -1;
+  }
+
+  memset(addrp, 0, sizeof (*addrp));
+  addrp->sin_family = AF_INET;
+  addrp->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addrp->sin_port = 0;
+
+  if (bind(fd, (struct sockaddr *)addrp, sizeof (*addrp)) == -1 ||
+      getsockname(fd, (struct sockaddr *)addrp, &addr_len) == -1) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+/*
+ * Creates a one-way channel in fds[], laid out like pipe(): data written to
+ * fds[PIPE_WR_END] can be read from fds[PIPE_RD_END]. Socket transports are
+ * connected over loopback (or AF_UNIX) and only ever used in one direction.
+ * Returns 0 on success.
+ */
+int
+create_channel(int transport, int busy_poll_microseconds, int fds[2])
+{
+  int listen_fd, rd_fd = -1, wr_fd = -1;
+  struct sockaddr_in rd_addr, wr_addr;
+
+  switch (transport)
+  {
+  case TRANSPORT_PIPE:
+    return pipe(fds);
+  case TRANSPORT_UNIX:
+    return socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+  case TRANSPORT_TCP:
+    listen_fd = create_loopback_socket(SOCK_STREAM, &rd_addr);
+    if (listen_fd == -1) {
+      break;
+    }
+    if (listen(listen_fd, 1) == -1) {
+      close(listen_fd);
+      break;
+    }
+    wr_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (wr_fd == -1 ||
+        connect(wr_fd, (struct sockaddr *)&rd_addr, sizeof (rd_addr)) == -1) {
+      close(listen_fd);
+      break;
+    }
+    rd_fd = accept(listen_fd, NULL, NULL);
+    close(listen_fd);
+    break;
+  case TRANSPORT_UDP:
+    rd_fd = create_loopback_socket(SOCK_DGRAM, &rd_addr);
+    wr_fd = create_loopback_socket(SOCK_DGRAM, &wr_addr);
+    if (rd_fd == -1 || wr_fd == -1 ||
+        connect(rd_fd, (struct sockaddr *)&wr_addr, sizeof (wr_addr)) == -1 ||
+        connect(wr_fd, (struct sockaddr *)&rd_addr, sizeof (rd_addr)) == -1) {
+      close(rd_fd);
+      rd_fd = -1;
+    }
+    break;
+  }
+
+  if (rd_fd == -1 || wr_fd == -1 ||
+      set_socket_options(rd_fd, transport, busy_poll_microseconds) != 0 ||
+      set_socket_options(wr_fd, transport, busy_poll_microseconds) != 0) {
+    if (rd_fd != -1)
+      close(rd_fd);
+    if (wr_fd != -1)
+      close(wr_fd);
+    return -1;
+  }
+
+  fds[PIPE_RD_END] = rd_fd;
+  fds[PIPE_WR_END] = wr_fd;
+
+  return 0;
+}
+
 void
 logging(int logging_enabled, FILE *fp, const char *format, ...)
 {
@@ -97,6 +518,11 @@ read_bytes(int fd, uint32_t bytes_to_read, void *buf)
       return -1;
     }
 
+    // the other end has gone away
+    if (bytes_read == 0) {
+      return -1;
+    }
+
     if (bytes_read < bytes_remaining) {
       bytes_remaining -= bytes_read;
       read_location += bytes_read;
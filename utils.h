@@ -1,3 +1,6 @@
+#ifndef UTILS_H
+#define UTILS_H
+
 #include <stdint.h>
 
 #define PRINT(args...)          logging(1, stdout, args)
@@ -7,11 +10,107 @@
 #define PIPE_RD_END             0
 #define PIPE_WR_END             1
 
+#define CACHE_LINE_SIZE         64
+
+// Hint to the CPU that we are in a spin-wait loop.
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax()             __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define cpu_relax()             __asm__ __volatile__("yield" ::: "memory")
+#else
+#define cpu_relax()             do { } while (0)
+#endif
+
+// Optional command line features, passed to get_args() by tests that
+// support them. -l and -i are always accepted.
+#define ARGS_OPEN_LOOP          0x1
+#define ARGS_TRANSPORT          0x2
+#define ARGS_SPIN               0x4
+#define ARGS_CHAIN              0x8
+#define ARGS_SLEEP              0x10
+#define ARGS_SWEEP              0x20
+#define ARGS_THREADS            0x40
+#define ARGS_SOAK               0x80
+#define ARGS_CHANNELS           0x100
+#define ARGS_SPAWN              0x200
+#define ARGS_TRANSFER           0x400
+
+// Features shared by the parent/child wakeup tests.
+#define ARGS_COMMON             (ARGS_SLEEP | ARGS_SWEEP | ARGS_THREADS | \
+                                 ARGS_SOAK)
+
+// Transports that create_channel() can set up in place of a pipe.
+#define TRANSPORT_PIPE          0
+#define TRANSPORT_UNIX          1
+#define TRANSPORT_TCP           2
+#define TRANSPORT_UDP           3
+
+// Channel kinds that many-channel-timer can wait on.
+#define CHANNEL_PIPE            0
+#define CHANNEL_EVENTFD         1
+
+typedef struct {
+  int                   logging;
+  int                   iterations;
+  int                   sleep_microseconds;
+
+  // Idle-duration sweep: instead of random sleeps, idle the child for each
+  // duration from 0 to |sweep_microseconds| for |iterations| pokes each.
+  int                   sweep_microseconds;
+  int                   record_cpu_state;
+
+  // Run the parent and child sides as two threads of one process instead of
+  // forking.
+  int                   threads;
+
+  // Soak mode: run for |duration_seconds| and report rolling statistics
+  // every |window_seconds|, counting samples over |threshold_nanoseconds|.
+  int                   duration_seconds;
+  int                   window_seconds;
+  int                   threshold_nanoseconds;
+
+  // Open-loop mode: pokes are sent at |rate| per second regardless of
+  // whether earlier pokes have been answered. 0 means closed-loop.
+  int                   rate;
+  int                   poisson;
+
+  // TRANSPORT_* used for the poke and reply channels, and the SO_BUSY_POLL
+  // value for socket transports.
+  int                   transport;
+  int                   busy_poll_microseconds;
+
+  // Spin-before-block: the child polls for up to |spin_iterations| (pausing,
+  // or yielding with |spin_yield|) before blocking. |spin_sweep_max| sweeps
+  // the spin count from 0 to that maximum instead.
+  int                   spin_iterations;
+  int                   spin_yield;
+  int                   spin_sweep_max;
+
+  // Pipeline stages for chain-timer: the -H argument, either a stage count or
+  // a per-stage list, which chain-timer parses.
+  const char            *stages;
+
+  // many-channel-timer: the number of channels (0 sweeps) and their
+  // CHANNEL_* kind.
+  int                   channels;
+  int                   channel_kind;
+
+  // spawn-timer: the parent's resident memory (-1 sweeps).
+  int                   megabytes;
+
+  // bulk-transfer-timer: the transfer size (0 sweeps).
+  int                   transfer_bytes;
+} test_args_t;
+
 int read_bytes(int fd, uint32_t bytes_to_read, void *buf);
 int write_bytes(int fd, uint32_t bytes_to_write, void *buf);
 void logging(int logging_enabled, FILE *fp, const char *format, ...);
 void *create_shared_memory(size_t shm_size);
+int parse_transport(const char *name);
+int create_channel(int transport, int busy_poll_microseconds, int fds[2]);
 void random_usleep(uint64_t max_microseconds);
-void usage(int argc, char **argv);
-int get_args(int argc, char **argv,
-    int *sleepp, int *loggingp, int *iterationsp);
+uint64_t next_arrival_nanoseconds(test_args_t *argsp);
+void usage(char **argv, int flags);
+int get_args(int argc, char **argv, int flags, test_args_t *argsp);
+
+#endif